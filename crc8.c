@@ -0,0 +1,25 @@
+/* $Id: crc8.c $
+ * CRC8 with polynomial 0x31 (x^8 + x^5 + x^4 + 1), as used by the LaCrosse
+ * protocol and the SHT31.
+ * This is table driven, but processes a nibble at a time, so the table
+ * only has 16 entries instead of 256 - we don't have the flash for more.
+ */
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <inttypes.h>
+#include "crc8.h"
+
+/* CRC of the upper nibble i, i.e. of the byte (i << 4) run through 4 bits */
+static const uint8_t crc8nibtab[16] PROGMEM = {
+  0x00, 0x31, 0x62, 0x53, 0xc4, 0xf5, 0xa6, 0x97,
+  0xb9, 0x88, 0xdb, 0xea, 0x7d, 0x4c, 0x1f, 0x2e
+};
+
+uint8_t crc8_update(uint8_t crc, uint8_t data)
+{
+  crc ^= data;
+  crc = (uint8_t)(crc << 4) ^ pgm_read_byte(&crc8nibtab[crc >> 4]);
+  crc = (uint8_t)(crc << 4) ^ pgm_read_byte(&crc8nibtab[crc >> 4]);
+  return crc;
+}
@@ -0,0 +1,14 @@
+/* $Id: crc8.h $
+ * CRC8 with polynomial 0x31, as used by the LaCrosse protocol and the SHT31
+ */
+
+#ifndef _CRC8_H_
+#define _CRC8_H_
+
+#include <inttypes.h>
+
+/* Feed one more byte into the CRC. Start with 0 for LaCrosse frames,
+ * with 0xff for SHT31 data. */
+uint8_t crc8_update(uint8_t crc, uint8_t data);
+
+#endif /* _CRC8_H_ */
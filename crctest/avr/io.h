@@ -0,0 +1,4 @@
+/* $Id: io.h $
+ * Stand-in for <avr/io.h>, so crc8.c can be compiled on the host for
+ * 'make crctest'. crc8.c does not use anything from it.
+ */
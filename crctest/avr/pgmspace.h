@@ -0,0 +1,12 @@
+/* $Id: pgmspace.h $
+ * Stand-in for <avr/pgmspace.h>, so crc8.c can be compiled on the host for
+ * 'make crctest': on the host, there is no separate program memory.
+ */
+
+#ifndef _CRCTEST_PGMSPACE_H_
+#define _CRCTEST_PGMSPACE_H_
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+
+#endif /* _CRCTEST_PGMSPACE_H_ */
@@ -0,0 +1,188 @@
+/* $Id: crctest.c $
+ * Checks both table driven implementations of CRC8 with polynomial 0x31
+ * against the bit by bit code they replaced: the 256 entry table of
+ * hostreceiverforjeelink (lcccrctab.h), and the nibble table of the
+ * firmware (crc8.c, built for the host against stubs in crctest/avr/).
+ * First for every combination of CRC and byte, then on the vectors in
+ * the file given on the command line. With -t, it also times all of them
+ * and prints nanoseconds per byte.
+ * Run through 'make crctest'. Exits with 1 if anything does not match.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include "../crc8.h"
+#include "../lcccrctab.h"
+
+/* As LaCrosseITPlusReader (and the firmware for the LaCrosse frames) used
+ * to do it. */
+static uint8_t bitwisecrc(uint8_t crc, uint8_t * data, int len) {
+  int i, j;
+  for (j = 0; j < len; j++) {
+    uint8_t val = data[j];
+    for (i = 0; i < 8; i++) {
+      uint8_t tmp = (uint8_t)((crc ^ val) & 0x80);
+      crc <<= 1;
+      if (0 != tmp) {
+        crc ^= 0x31;
+      }
+      val <<= 1;
+    }
+  }
+  return crc;
+}
+
+/* As Sensirions example code (and the firmware for the SHT31) used to do
+ * it - a different way to get to the same result. */
+static uint8_t bitwisecrcsht(uint8_t crc, uint8_t * data, int len) {
+  int j;
+  uint8_t b;
+  for (j = 0; j < len; j++) {
+    crc ^= data[j];
+    for (b = 0; b < 8; b++) {
+      if (crc & 0x80) {
+        crc = (crc << 1) ^ 0x131;
+      } else {
+        crc = crc << 1;
+      }
+    }
+  }
+  return crc;
+}
+
+static uint8_t tablecrc(uint8_t crc, uint8_t * data, int len) {
+  int j;
+  for (j = 0; j < len; j++) {
+    crc = lcccrctab[crc ^ data[j]];
+  }
+  return crc;
+}
+
+static uint8_t nibblecrc(uint8_t crc, uint8_t * data, int len) {
+  int j;
+  for (j = 0; j < len; j++) {
+    crc = crc8_update(crc, data[j]);
+  }
+  return crc;
+}
+
+static int fails = 0;
+
+static void check(const char * what, uint8_t crc, uint8_t * data, int len,
+                  int expected) {
+  uint8_t res[4];
+  static const char * names[4] = { "bitwise", "bitwise (SHT31)", "host table", "firmware nibble table" };
+  int i;
+
+  res[0] = bitwisecrc(crc, data, len);
+  res[1] = bitwisecrcsht(crc, data, len);
+  res[2] = tablecrc(crc, data, len);
+  res[3] = nibblecrc(crc, data, len);
+  if (expected < 0) expected = res[0];
+  for (i = 0; i < 4; i++) {
+    if (res[i] != expected) {
+      printf("FAIL: %s: %s gives %02x, expected %02x\n", what, names[i], res[i], expected);
+      fails++;
+    }
+  }
+}
+
+/* Times every implementation on the same TIMEBUFSIZE bytes of random
+ * data, TIMEROUNDS times over. */
+#define TIMEBUFSIZE 4096
+#define TIMEROUNDS 2000
+static void timeall(void) {
+  static uint8_t (* const impls[4])(uint8_t, uint8_t *, int) = {
+    bitwisecrc, bitwisecrcsht, tablecrc, nibblecrc
+  };
+  static const char * names[4] = { "bitwise", "bitwise (SHT31)", "host table", "firmware nibble table" };
+  static uint8_t buf[TIMEBUFSIZE];
+  struct timespec start, end;
+  volatile uint8_t sink;
+  uint8_t crc;
+  double ns;
+  int i, r;
+
+  srand(1);
+  for (i = 0; i < TIMEBUFSIZE; i++) {
+    buf[i] = rand();
+  }
+  for (i = 0; i < 4; i++) {
+    crc = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (r = 0; r < TIMEROUNDS; r++) {
+      crc = impls[i](crc, buf, TIMEBUFSIZE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sink = crc;
+    ns = ((end.tv_sec - start.tv_sec) * 1e9) + (end.tv_nsec - start.tv_nsec);
+    printf("%-22s %6.2f ns/byte\n", names[i], ns / ((double)TIMEBUFSIZE * TIMEROUNDS));
+  }
+  (void)sink;
+}
+
+int main(int argc, char ** argv) {
+  FILE * f;
+  char line[1000];
+  char what[1100];
+  uint8_t data[sizeof(line) / 2];
+  unsigned int crc, expected, v;
+  char * hex;
+  int lineno = 0;
+  int nvec = 0;
+  int timeit = 0;
+  char * fn;
+  int len;
+
+  if ((argc > 1) && (strcmp(argv[1], "-t") == 0)) {
+    timeit = 1;
+  }
+  for (crc = 0; crc < 256; crc++) {
+    for (v = 0; v < 256; v++) {
+      data[0] = v;
+      sprintf(what, "crc %02x byte %02x", crc, v);
+      check(what, crc, data, 1, -1);
+    }
+  }
+  if (argc < (2 + timeit)) {
+    fprintf(stderr, "usage: %s [-t] <vectorfile>\n", argv[0]);
+    return 1;
+  }
+  fn = argv[1 + timeit];
+  if ((f = fopen(fn, "r")) == NULL) {
+    fprintf(stderr, "ERROR: Could not open %s.\n", fn);
+    return 1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineno++;
+    line[strcspn(line, "\r\n")] = 0;
+    if ((line[0] == 0) || (line[0] == '#')) continue;
+    hex = strchr(line, ' ');
+    if ((hex == NULL) || (sscanf(line, "%x", &crc) != 1)
+     || (sscanf(strrchr(line, ' '), " %x", &expected) != 1)) {
+      fprintf(stderr, "ERROR: %s line %d is not a vector.\n", fn, lineno);
+      return 1;
+    }
+    hex++;
+    for (len = 0; (hex[0] != '-') && (hex[0] != ' ') && (hex[0] != 0); len++) {
+      if (sscanf(hex, "%2x", &v) != 1) {
+        fprintf(stderr, "ERROR: %s line %d is not a vector.\n", fn, lineno);
+        return 1;
+      }
+      data[len] = v;
+      hex += 2;
+    }
+    sprintf(what, "%s line %d", fn, lineno);
+    check(what, crc, data, len, expected);
+    nvec++;
+  }
+  fclose(f);
+  printf("%d vectors and all 65536 crc/byte pairs checked, %d failures.\n", nvec, fails);
+  if (timeit) {
+    timeall();
+  }
+  return (fails == 0) ? 0 : 1;
+}
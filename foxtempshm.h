@@ -0,0 +1,126 @@
+/* $Id: foxtempshm.h $
+ * Layout of the shared memory table hostreceiverforjeelink exports with -m,
+ * and a small header-only reader for it. Reading a sensor from the table
+ * needs no syscalls and no locking: every slot is protected by a seqlock,
+ * so a reader simply retries in the rare case it caught the daemon in the
+ * middle of an update.
+ *
+ * Usage:
+ *   struct foxtempshm * shm = foxtempshm_open("/foxtemp");
+ *   struct foxtempshmslot s;
+ *   if ((foxtempshm_read(shm, 'F', 23, &s) == 0)
+ *    && foxtempshm_valid(&s, time(NULL))
+ *    && (s.valid & (1 << FOXTEMPSHM_T))) {
+ *     printf("%.2f\n", s.values[FOXTEMPSHM_T]);
+ *   }
+ */
+
+#ifndef _FOXTEMPSHM_H_
+#define _FOXTEMPSHM_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FOXTEMPSHM_MAGIC 0x46545348 /* "FTSH" */
+#define FOXTEMPSHM_VERSION 1
+#define FOXTEMPSHM_MAXTYPES 8
+
+/* Indexes into values[], and bits in valid */
+#define FOXTEMPSHM_T 0        /* temperature, degrees celsius */
+#define FOXTEMPSHM_H 1        /* relative humidity, percent */
+#define FOXTEMPSHM_B 2        /* barometric pressure, hPa */
+#define FOXTEMPSHM_V 3        /* battery voltage */
+#define FOXTEMPSHM_PM2_5 4    /* particulate matter 2.5u, ug/m3 */
+#define FOXTEMPSHM_PM10 5     /* particulate matter 10u, ug/m3 */
+#define FOXTEMPSHM_CPM1 6     /* counts per minute, 1 minute average */
+#define FOXTEMPSHM_UV 7       /* UV index */
+#define FOXTEMPSHM_SOLAR 8    /* solar intensity, W/m2 */
+#define FOXTEMPSHM_RAINRATE 9 /* mm/h */
+#define FOXTEMPSHM_CPM60 10   /* counts per minute, 60 minute average */
+#define FOXTEMPSHM_RAINTIPS 11 /* rain bucket tip counter */
+#define FOXTEMPSHM_NUMVALUES 12
+
+struct foxtempshmslot {
+  uint32_t seq; /* odd while the daemon is writing to this slot */
+  uint8_t sensortype; /* 0 if the daemon does not serve this sensor */
+  uint8_t sensorid;
+  uint16_t valid; /* bitmask of the values that are set */
+  int64_t lastseen; /* unix timestamp, 0 if never */
+  int64_t validuntil; /* data is stale after this */
+  double values[FOXTEMPSHM_NUMVALUES];
+};
+
+struct foxtempshm {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slotsize; /* sizeof(struct foxtempshmslot) */
+  uint32_t ntypes;
+  char types[FOXTEMPSHM_MAXTYPES]; /* the sensortypes, in the order of the slots */
+  /* ntypes * 256 of these, indexed by typeindex * 256 + sensorid */
+  struct foxtempshmslot slots[];
+};
+
+#define FOXTEMPSHM_SIZE(ntypes) \
+  (sizeof(struct foxtempshm) + ((ntypes) * 256 * sizeof(struct foxtempshmslot)))
+
+/* Maps the table read-only. Returns NULL if it does not exist, or was
+ * written by an incompatible version of the daemon. */
+static inline struct foxtempshm * foxtempshm_open(const char * name) {
+  struct foxtempshm * shm;
+  struct stat st;
+  int fd;
+
+  if ((fd = shm_open(name, O_RDONLY, 0)) < 0) return NULL;
+  if ((fstat(fd, &st) != 0) || (st.st_size < sizeof(struct foxtempshm))) {
+    close(fd);
+    return NULL;
+  }
+  shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED) return NULL;
+  if ((shm->magic != FOXTEMPSHM_MAGIC) || (shm->version != FOXTEMPSHM_VERSION)
+   || (shm->slotsize != sizeof(struct foxtempshmslot))
+   || (shm->ntypes > FOXTEMPSHM_MAXTYPES)
+   || (st.st_size < FOXTEMPSHM_SIZE(shm->ntypes))) {
+    munmap(shm, st.st_size);
+    return NULL;
+  }
+  return shm;
+}
+
+static inline void foxtempshm_close(struct foxtempshm * shm) {
+  munmap(shm, FOXTEMPSHM_SIZE(shm->ntypes));
+}
+
+/* Copies a consistent snapshot of one sensor into out. Returns -1 for
+ * unknown sensortypes and sensors the daemon does not serve. */
+static inline int foxtempshm_read(struct foxtempshm * shm, char stype,
+                                  uint8_t sid, struct foxtempshmslot * out) {
+  const struct foxtempshmslot * slot;
+  uint32_t s1, s2;
+  int ti;
+
+  for (ti = 0; ti < shm->ntypes; ti++) {
+    if (shm->types[ti] == stype) break;
+  }
+  if (ti >= shm->ntypes) return -1;
+  slot = &shm->slots[(ti * 256) + sid];
+  do {
+    s1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    memcpy(out, (const void *)slot, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    s2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+  } while ((s1 & 1) || (s1 != s2));
+  return (out->sensortype == 0) ? -1 : 0;
+}
+
+/* Whether the data in a slot is still valid at time now. */
+static inline int foxtempshm_valid(const struct foxtempshmslot * s, int64_t now) {
+  return (s->lastseen != 0) && (now <= s->validuntil);
+}
+
+#endif /* _FOXTEMPSHM_H_ */
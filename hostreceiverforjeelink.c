@@ -11,6 +11,7 @@
  * implementation of avrusb, although close to nothing of that should remain.
  */
 
+#define _GNU_SOURCE /* for memfd_create() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,13 +19,24 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
-#include <sys/select.h>  /* According to POSIX.1-2001 */
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <termios.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include "foxtempshm.h"
+#include "lcccrctab.h"
 
 int verblev = 1;
 #define VERBPRINT(lev, fmt...) \
@@ -35,48 +47,517 @@ int verblev = 1;
 int runinforeground = 0;
 unsigned char * serialport = "/dev/ttyUSB2";
 int restartonerror = 0;
-time_t datavalidduration = 180;
+time_t datavalidduration = 180; /* until we know how often a sensor sends */
 #define RECTJEELINK 0
 #define RECTCUL 1
 #define RECTJEELDAVISV 2
-int receivertype = RECTJEELINK;
+static const char * rectnames[] = { "jeelink", "cul", "davis" };
+int receivertype = RECTJEELINK; /* for -d without a type prefix */
+unsigned int queryport = 0;
+unsigned int histsize = 2880; /* history entries kept per sensor */
+char * logdir = NULL;
+int userollups = 0;
+/* In replay mode, the time comes from the capture, not from the clock. */
+time_t replayclock = 0;
+int trackallsensors = 0;
+int querylistenfd = -1;
+unsigned int metricsport = 0;
+int metricslistenfd = -1;
+unsigned int statsport = 0;
+int statslistenfd = -1;
+char * mcastdest = NULL;
+int mcastfd = -1;
+char * shmname = NULL;
+struct foxtempshm * shmtable = NULL;
+/* Everything for the metrics port is rendered into one buffer, so a
+ * scrape only has to write it out. The main loop rebuilds it when data
+ * went stale, and when new data arrived - but at most once per
+ * METRICSDELAYMS, so a burst of frames only causes one rebuild. */
+#define METRICSDELAYMS 1000
+static char * metricsbody = NULL;
+static int metricslen = 0;
+static int metricssize = 0;
+static int metricsdirty = 1;
+static long long metricsdirtyms = 0;
+static time_t metricsexpires = 0;
+int epfd = -1;
 
-struct daemondata {
+/* Everything we put into our epoll set carries one of these, so the
+ * main loop can tell what kind of fd just became ready. */
+#define EVT_SERIAL 0
+#define EVT_SENSORLISTEN 1
+#define EVT_QUERYLISTEN 2
+#define EVT_QUERYCONN 3
+#define EVT_METRICSLISTEN 4
+#define EVT_STATSLISTEN 5
+struct evhandle {
+  int evtype;
+  void * obj;
+};
+
+/* A receiver (JeeLink, CUL, ...) attached to a serial port. There can be
+ * several of them, possibly of different types, all feeding the same
+ * sensors. */
+#define LLSIZE 1000 /* longest line we accept from a receiver, plus 1 */
+#define INBUFSIZE 4096
+struct receiver {
+  struct evhandle evh;
+  unsigned char * devname;
+  int type; /* one of the RECT*, -1 until known */
+  int fd;
+  char initstr[500];
+  time_t lastsentinit;
+  pthread_mutex_t initlock; /* for initstr and lastsentinit, a reload might change them */
+  time_t lastdatarecv;
+  /* What was read from the serial port, but not processed yet. Complete
+   * lines are parsed right from here, only the last incomplete one is
+   * kept for the next read. */
+  unsigned char inbuf[INBUFSIZE];
+  unsigned int inlen;
+  int discarding; /* dropping the rest of an overlong line */
+  /* In daemon mode, every receiver is read by a thread of its own, so that
+   * nothing the main thread does can delay reading. It hands the decoded
+   * frames over through ring, and wakes the main thread through evfd.
+   * ringhead is only written by the reading thread, ringtail only by the
+   * main thread. ring is NULL without a thread (replay, bench). */
+  struct ringitem * ring;
+  unsigned int ringhead;
+  unsigned int ringtail;
+  int evfd;
+  int readerr; /* set by the thread before it gives up */
+  pthread_t thread;
+  /* Counters for the stats port. They only ever go up. All but ndupes are
+   * written by the reading thread, and only through RCCOUNT(), so reading
+   * them from the main thread with RCREAD() is fine, if maybe slightly
+   * outdated. */
+  unsigned long nlines;
+  unsigned long nframes; /* lines that were a valid frame */
+  unsigned long ndupes; /* frames already received through another receiver */
+  unsigned long ncrcfail;
+  unsigned long nbadlen;
+  unsigned long nculfwtrunc; /* packets cut off at 12 bytes by culfw */
+  unsigned long nunknowntype;
+  unsigned long nreboots;
+  unsigned long nringfull; /* times we had to wait for the main thread */
+  unsigned long noverlong; /* lines too long to be anything we know */
+  struct receiver * next;
+};
+struct receiver * receivers = NULL;
+/* For what the reading thread writes and the main thread reads, without
+ * any other synchronization: only one thread ever writes, so a plain
+ * increment is fine, as long as neither side can see half of a value. */
+#define RCCOUNT(rc, ctr) \
+  __atomic_store_n(&(rc)->ctr, (rc)->ctr + 1, __ATOMIC_RELAXED)
+#define RCREAD(rc, field) __atomic_load_n(&(rc)->field, __ATOMIC_RELAXED)
+
+/* A packet received from a sensor, no matter through which receiver.
+ * For custom sensors, data is what follows the length byte in the packet.
+ * For LaCrosse sensors, it is the 4 bytes the JeeLink firmware reports. */
+#define FRAME_CUSTOM 1
+#define FRAME_LACROSSE 2
+#define FRAME_DAVIS 3
+#define RXFRAMEMAXLEN 24 /* enough for a FRAME_DAVIS */
+#define CUSTOMMAXLEN 16 /* none of our sensors sends more */
+struct rxframe {
+  unsigned char kind;
+  unsigned char sensorid;
+  unsigned char len;
+  unsigned char data[RXFRAMEMAXLEN];
+};
+
+/* The values decoded from a frame. Values a sensor does not have are
+ * set to the 'invalid' markers from initreading(). */
+struct sensorreading {
+  double temp;
+  double hum;
+  double voltage;
+  double pressure;
+  double pm2_5;
+  double pm10;
+  double uv;
+  double solar;
+  double rainrate;
+  uint32_t cpm1;
+  uint32_t cpm60;
+  uint32_t raintipcount;
+};
+
+/* A frame as kept in the history of a sensor - the sensorid is implied. */
+struct histframe {
+  uint8_t kind;
+  uint8_t len;
+  uint8_t data[RXFRAMEMAXLEN];
+};
+
+/* What we write to the on-disk log for every frame. There is one file
+ * (segment) per day (UTC), named YYYYMMDD.ftl, and since records are only
+ * ever appended, they are sorted by time within it. All in the native byte
+ * order of the machine. */
+struct logrecord {
+  uint32_t ts;
+  uint8_t sensortype;
+  uint8_t sensorid;
+  uint8_t kind;
+  uint8_t len;
+  uint8_t data[RXFRAMEMAXLEN];
+};
+
+/* Min/max/avg of the values received from a sensor are kept per minute,
+ * hour and day (UTC), each in a ring of buckets. A bucket is identified by
+ * its start time divided by the length of the period, a bucket in the ring
+ * with a different start is just old data that will be overwritten. */
+#define ROLL_T 0
+#define ROLL_H 1
+#define ROLL_B 2
+#define ROLL_V 3
+#define ROLL_PM2_5 4
+#define ROLL_PM10 5
+#define ROLL_CPM1 6
+#define ROLL_UV 7
+#define ROLL_SOLAR 8
+#define ROLL_RAINRATE 9
+#define NUMROLLFIELDS 10
+static const char * rollfieldnames[NUMROLLFIELDS] = {
+  "T", "H", "B", "V", "PM2.5u", "PM10u", "c", "UV", "UI", "RR"
+};
+struct rollfield {
+  float min;
+  float max;
+  double sum;
+  uint32_t count;
+};
+struct rollbucket {
+  uint32_t start;
+  struct rollfield f[NUMROLLFIELDS];
+};
+#define NUMROLLPERIODS 3
+static const struct {
+  char letter;
+  unsigned int seconds;
+  unsigned int nbuckets;
+} rollperiods[NUMROLLPERIODS] = {
+  { 'm',    60, 120 }, /* 2 hours */
+  { 'h',  3600, 168 }, /* 1 week */
+  { 'd', 86400, 400 }  /* more than a year */
+};
+
+#define NUMGAPS 16
+/* The last values received from one sensor. There is exactly one of these
+ * for every sensortype+sensorid we serve, no matter on how many ports. */
+struct sensorstate {
   unsigned char sensortype;
   unsigned char sensorid;
+  time_t lastseen;
+  struct sensorreading last;
+  struct daemondata * subscribers; /* everything serving this sensor */
+  struct queryconn * pushconns; /* query connections subscribed to it */
+  int retired; /* no longer served since a reload, but kept in case it returns */
+  /* The last frame we used, so we can recognize it when it arrives again
+   * through another receiver. */
+  struct rxframe lastframe;
+  struct receiver * lastframefrom;
+  long long lastframems;
+  /* The last histsize frames received, as a ring. Timestamps are kept in
+   * their own array, so searching through them touches as little memory
+   * as possible. */
+  uint32_t * histts;
+  struct histframe * histframes;
+  unsigned int histhead; /* where the next one goes */
+  unsigned int histcount;
+  unsigned long histadded; /* all that were ever added, for histcursors */
+  struct rollbucket * rollups[NUMROLLPERIODS]; /* only with -A */
+  unsigned long nframes; /* for the stats port */
+  unsigned long nqueries;
+  /* The last NUMGAPS times between two frames, to learn how often the sensor
+   * sends. interval is their median, 0 while we have not seen enough.
+   * longestgap is the longest of them that is still a regular one, not
+   * one with lost transmissions in it. */
+  uint16_t gaps[NUMGAPS];
+  unsigned int gappos;
+  unsigned int ngaps;
+  time_t interval;
+  time_t longestgap;
+  unsigned long nmissed; /* transmissions we estimate to have missed */
+};
+
+/* outputformats get compiled into a list of these once, so that rendering
+ * them does not need to parse the format string again every time. */
+#define FOP_LITERAL 0
+#define FOP_PRESSURE 1     /* %B */
+#define FOP_PRESSUREINT 2  /* %b */
+#define FOP_CPM1 3         /* %c */
+#define FOP_CPM60 4        /* %C */
+#define FOP_HUMFIX2 5      /* %H */
+#define FOP_HUMVAR2 6      /* %h */
+#define FOP_HUMFIX1 7      /* %F */
+#define FOP_HUMVAR1 8      /* %f */
+#define FOP_LASTSEEN 9     /* %L */
+#define FOP_PM2_5 10       /* %PM2.5u */
+#define FOP_PM10 11        /* %PM10u */
+#define FOP_RAINRATE 12    /* %RR */
+#define FOP_RAINTIPS 13    /* %RT */
+#define FOP_SENSORID 14    /* %S */
+#define FOP_TEMPFIX 15     /* %T */
+#define FOP_TEMPVAR 16     /* %t */
+#define FOP_UV 17          /* %UV */
+#define FOP_SOLAR 18       /* %UI */
+#define FOP_VOLTAGE 19     /* %V */
+#define FOP_ROLLUP 20      /* %A<period><stat><value> */
+/* No value we output can get longer than this. Anything that would (e.g.
+ * garbage received from a sensor) gets cut off. */
+#define FOPMAXLEN 16
+struct fmtop {
+  unsigned char op;
+  unsigned char rperiod, rstat, rfield; /* FOP_ROLLUP only */
+  unsigned short litoff; /* FOP_LITERAL only: where in lits the text is */
+  unsigned short litlen;
+};
+struct compiledfmt {
+  int nops;
+  struct fmtop * ops;
+  unsigned char * lits;
+  int maxlen; /* upper bound for the length of the rendered output */
+  unsigned int rollsecs; /* shortest rollup period used, 0 for none */
+};
+
+#define OUTBUFSIZE 250
+struct daemondata {
+  struct evhandle evh;
+  char * param; /* the daemon parameter this was created from */
+  unsigned char stype;
+  unsigned char sid;
+  struct sensorstate * ss;
   unsigned int port;
   int fd;
-  time_t lastseen;
-  double lasttemp;
-  double lasthum;
-  double lastvoltage;
-  double lastpressure;
-  double lastpm2_5;
-  double lastpm10;
-  double lastuv;
-  double lastsolar;
-  double lastrainrate;
-  uint32_t lastcpm1;
-  uint32_t lastcpm60;
-  uint32_t lastraintipcount;
   unsigned char outputformat[1000];
+  struct compiledfmt cfmt;
+  /* The output for this port, rendered whenever new data arrives. It only
+   * needs to be rendered again when it expires (the data going stale, or
+   * the period of a rollup in the format ending), a cacheexpires of 0
+   * means it is valid until new data arrives. */
+  char cachedout[OUTBUFSIZE];
+  int cachedlen;
+  time_t cacheexpires;
+  struct daemondata * nextforsensor;
   struct daemondata * next;
 };
 
+/* A client connected to the query port. It first has to tell us which
+ * sensor it wants, so we need to keep some state until that arrived.
+ * Clients that subscribed stay connected and get a line pushed for every
+ * update. What they have not read yet is queued in outq - if that runs
+ * full, the client is too slow and gets disconnected, we will not wait
+ * for it. */
+#define QCBUFSIZE 1100
+#define SUBQSIZE 8192
+/* Clients may not send outputformats longer than we allow for ports */
+#define MAXFMTLEN (sizeof(((struct daemondata *)0)->outputformat) - 1)
+#define ERRFMTTOOLONG "ERROR: outputformat too long\n"
+struct queryconn {
+  struct evhandle evh;
+  int fd;
+  struct sockaddr_in6 srcad;
+  socklen_t adrlen;
+  unsigned char inbuf[QCBUFSIZE];
+  int inlen;
+  int ishttp; /* connected to the metrics port instead */
+  struct sensorstate * ss; /* only set for subscribers */
+  struct compiledfmt cfmt;
+  char * outq;
+  int outqlen;
+  int outqsize;
+  struct logcursor * logcur; /* set while answering a logdump request */
+  struct histcursor * histcur; /* set while answering a history request */
+  int wantout; /* whether EPOLLOUT is currently set for fd */
+  int rdclosed; /* they will not send anything anymore */
+  int dead; /* closed, but there may still be events for it pending */
+  time_t lastactive; /* when we last got something from or to them */
+  struct queryconn * nextpush;
+  struct queryconn * nextconn; /* all that are not dead, for timeouts */
+  struct queryconn * prevconn;
+};
+static struct queryconn * allqueryconns = NULL;
+/* Clients that make us wait for their request, or do not read what we send
+ * them, for this long get disconnected. Subscribers with nothing to send
+ * can stay as long as they like. */
+#define QCTIMEOUT 30
+/* Subscribers that got disconnected while handling one batch of events.
+ * They are only freed after the batch is done. */
+static struct queryconn * deadqueryconns = NULL;
+
+static time_t curtime(void) {
+  return (replayclock != 0) ? replayclock : time(NULL);
+}
+
+static void initreading(struct sensorreading * r) {
+  r->temp = -274.0;
+  r->hum = 106.0; /* LaCrosse sensors use 106 to show they have no
+                   * humidity data, so we just recycle that */
+  r->voltage = 0.0;
+  r->pressure = -1.0;
+  r->pm2_5 = -1.0;
+  r->pm10 = -1.0;
+  r->uv = -1.0;
+  r->solar = -1.0;
+  r->rainrate = -1.0;
+  r->cpm1 = 0xffffff;
+  r->cpm60 = 0xffffff;
+  r->raintipcount = 0xffffffff;
+}
+
+/* Index from sensortype+sensorid to the state of that sensor, so neither
+ * incoming data nor the query port need to walk the list of all sensors. */
+static const char knownsensortypes[] = "DFGHLSV";
+#define NUMSENSORTYPES (sizeof(knownsensortypes) - 1)
+static struct sensorstate * sensorindex[NUMSENSORTYPES][256];
+
+static int stypeidx(unsigned char stype) {
+  char * p;
+  if (stype == 0) return -1;
+  p = strchr(knownsensortypes, stype);
+  if (p == NULL) return -1;
+  return p - knownsensortypes;
+}
+
+static struct sensorstate * findsensor(unsigned char stype, unsigned char sid) {
+  int ti = stypeidx(stype);
+  if ((ti < 0) || (sensorindex[ti][sid] == NULL)) return NULL;
+  if (sensorindex[ti][sid]->retired) return NULL;
+  return sensorindex[ti][sid];
+}
+
+/* Like findsensor(), but creates the state if it does not exist yet.
+ * Returns NULL only for unknown sensortypes. */
+static struct sensorstate * getsensorstate(unsigned char stype, unsigned char sid) {
+  struct sensorstate * ss;
+  int ti = stypeidx(stype);
+  if (ti < 0) return NULL;
+  ss = sensorindex[ti][sid];
+  if (ss != NULL) {
+    ss->retired = 0;
+    return ss;
+  }
+  ss = calloc(sizeof(struct sensorstate), 1);
+  if (ss == NULL) {
+    fprintf(stderr, "ERROR: out of memory.\n");
+    exit(1);
+  }
+  ss->sensortype = stype;
+  ss->sensorid = sid;
+  /* Initialize contents to 'invalid' markers where applicable */
+  initreading(&ss->last);
+  /* For compatibility with what we always did */
+  ss->last.pm2_5 = 0.0;
+  ss->last.pm10 = 0.0;
+  ss->last.cpm1 = 0;
+  ss->last.cpm60 = 0;
+  if (userollups) {
+    int i;
+    for (i = 0; i < NUMROLLPERIODS; i++) {
+      ss->rollups[i] = calloc(sizeof(struct rollbucket), rollperiods[i].nbuckets);
+      if (ss->rollups[i] == NULL) {
+        fprintf(stderr, "ERROR: out of memory.\n");
+        exit(1);
+      }
+    }
+  }
+  if (histsize > 0) {
+    ss->histts = calloc(sizeof(uint32_t), histsize);
+    ss->histframes = calloc(sizeof(struct histframe), histsize);
+    if ((ss->histts == NULL) || (ss->histframes == NULL)) {
+      fprintf(stderr, "ERROR: out of memory.\n");
+      exit(1);
+    }
+  }
+  sensorindex[ti][sid] = ss;
+  return ss;
+}
+
+/* Parses a sensor in the format [sensortype]sensorid, e.g. "F23" or "42".
+ * Returns 0 on success, with endp pointing after the sensorid. */
+static int parsesensorkey(unsigned char * s, unsigned char * stype,
+                          unsigned char * sid, unsigned char ** endp) {
+  unsigned long l;
+  char * e;
+  if ((*s >= (unsigned char)'0') && (*s <= (unsigned char)'9')) {
+    /* JUST a number. This is easy. */
+    *stype = (unsigned char)'H';
+  } else {
+    if (stypeidx(toupper(*s)) < 0) return -1;
+    *stype = toupper(*s);
+    s++;
+  }
+  l = strtoul((char *)s, &e, 0);
+  if ((e == (char *)s) || (l > 255)) return -1;
+  *sid = l;
+  if (endp != NULL) *endp = (unsigned char *)e;
+  return 0;
+}
+
 static void usage(char *name)
 {
   printf("usage: %s [-v] [-q] [-d n] [-h] command <parameters>\n", name);
   printf(" -v     more verbose output. can be repeated numerous times.\n");
   printf(" -q     less verbose output. using this more than once will have no effect.\n");
-  printf(" -d p   Port to which the Jeelink is attached (default: %s)\n", serialport);
+  printf(" -d p   Port to which the Jeelink is attached (default: %s).\n", serialport);
+  printf("        Can be given more than once to use several receivers at the\n");
+  printf("        same time. p can be prefixed with the receiver type, one of\n");
+  printf("        'jeelink:', 'cul:' or 'davis:', otherwise -C / -D decide.\n");
   printf(" -r br  Select bitrate mode. -1 makes the JeeLink toggle, 1 or 9579\n");
   printf("        forces 9579 baud, 2 or 17241 forces 17241. The default 0 picks\n");
   printf("        a value based on the selected sensors.\n");
   printf(" -f     relevant for daemon mode only: run in foreground.\n");
   printf(" -C     receiver device is not a Jeelink but a CUL, running culfw >= 1.67\n");
   printf(" -D     receiver device is running the 'DavisVantage' receiver firmware\n");
+  printf("        (both only for -d without a receiver type prefix)\n");
+  printf(" -Q p   relevant for daemon mode only: also answer queries for all\n");
+  printf("        sensors on TCP port p. Clients send the sensor they want,\n");
+  printf("        optionally followed by an outputformat, terminated by a\n");
+  printf("        newline, e.g. 'F23' or 'F23 %%T %%H'. Prefixing that with\n");
+  printf("        'subscribe ' keeps the connection open, and a line is sent\n");
+  printf("        every time new data from the sensor arrives.\n");
+  printf("        'history F23 last 10' or 'history F23 since <timestamp>',\n");
+  printf("        again optionally followed by an outputformat, returns the\n");
+  printf("        stored history of the sensor, one line per frame received.\n");
+  printf("        'logdump F23 <from> <to>' does the same with the log (-l).\n");
+  printf("        Negative timestamps are relative to the current time.\n");
+  printf("        'rollup F23 h 24' returns min/avg/max/count of every value for\n");
+  printf("        the last 24 hours (m, h or d), 'rollup F23 d 90 total' over\n");
+  printf("        the last 90 days (requires -A).\n");
+  printf(" -P p   relevant for daemon mode only: serve the values of all\n");
+  printf("        sensors in OpenMetrics (Prometheus) format via HTTP on port p.\n");
+  printf("        The answer is rendered in advance, at most one second after\n");
+  printf("        the values change, so a scrape never has to wait for it.\n");
+  printf(" -S p   relevant for daemon mode only: send counters of lines,\n");
+  printf("        frames and errors per receiver, and of frames and queries per\n");
+  printf("        sensor, to everyone connecting to port p.\n");
+  printf(" -M a:p relevant for daemon mode only: send every frame received\n");
+  printf("        as a binary UDP datagram to multicast or broadcast address a,\n");
+  printf("        port p, e.g. '239.23.42.1:7777' or '[ff15::f0:7e]:7777'.\n");
+  printf(" -m n   relevant for daemon mode only: keep the current values of\n");
+  printf("        all sensors in POSIX shared memory n (e.g. '/foxtemp'), for\n");
+  printf("        local readers using foxtempshm.h.\n");
+  printf(" -c f   read receivers, ports and sensors from config file f (lines\n");
+  printf("        'receiver <p>', 'bitrate <br>', 'queryport <p>', 'metricsport\n");
+  printf("        <p>', 'statsport <p>', 'sensor <daemon parameter>'). In daemon\n");
+  printf("        mode, SIGHUP reloads it, changing only what changed.\n");
+  printf(" -H n   number of frames to keep in the history of every sensor\n");
+  printf("        (default: %u). 0 disables the history.\n", histsize);
+  printf(" -A     keep minimum, maximum and average of all values per minute,\n");
+  printf("        hour and day (UTC), for the %%A format codes and rollup queries\n");
+  printf(" -l dir write every frame received to a log in directory dir, with\n");
+  printf("        one file per day.\n");
+  printf(" --realtime  relevant for replay mode only: replay at the pace of the\n");
+  printf("        timestamps in the capture, instead of as fast as possible.\n");
   printf(" -h     show this help\n");
   printf("Valid commands are:\n");
+  printf(" bench    Run micro-benchmarks of the parsers and outputformats.\n");
+  printf(" replay   Feed a capture of what a receiver sent (- for stdin)\n");
+  printf("          through the parser, then print the final values of all\n");
+  printf("          sensors. Lines may be prefixed with '@<unix timestamp> '.\n");
+  printf("          The receiver type is selected with -C / -D. Optionally\n");
+  printf("          followed by the sensors to track (e.g. 'F23'), otherwise\n");
+  printf("          all sensors seen are tracked.\n");
   printf(" daemon   Daemonize and answer queries. This requires one or more\n");
   printf("          parameters in the format\n");
   printf("            [sensortype]sensorid:port[:outputformat]\n");
@@ -91,8 +572,16 @@ static void usage(char *name)
   printf("            V   some commercial weather stations made by Davis (special receiver\n");
   printf("                firmware required)\n");
   printf("          port is a TCP port where the data from this sensor is to be served\n");
+  printf("          It may be omitted or 0 if a query port (-Q), metrics\n");
+  printf("          port (-P), multicast (-M) or shared memory (-m) is used.\n");
   printf("          The optional outputformat specifies how the output to\n");
   printf("          the network should look like. Available format codes are:\n");
+  printf("            %%A<p><s><v> rollup of value v (one of the format codes T, H, B,\n");
+  printf("                     V, PM2.5u, PM10u, c, UV, UI, RR) for period p\n");
+  printf("                     (m, h, d for the current minute/hour/day so far,\n");
+  printf("                     M, H, D for the last complete one), s is one of\n");
+  printf("                     n (min), x (max), a (avg), c (count). Needs -A.\n");
+  printf("                     Example: '%%AHaT' for last hour's average temp.\n");
   printf("            %%B        barometric pressure\n");
   printf("            %%c        CPM 1 min\n");
   printf("            %%C        CPM 60 min\n");
@@ -168,903 +657,3908 @@ void logaccess(struct sockaddr * soa, int soalen, char * txt) {
   }
 }
 
-static void printtooutbuf(char * outbuf, int oblen, struct daemondata * dd) {
-  unsigned char * pos = &dd->outputformat[0];
+/* Parses the name of a value in a rollup format code or request, these are
+ * named like the format code for the value itself. Returns the ROLL_*, or
+ * -1 if unknown, and the length of the name in *len. */
+static int parserollfield(unsigned char * s, int * len) {
+  int i;
+  for (i = 0; i < NUMROLLFIELDS; i++) {
+    *len = strlen(rollfieldnames[i]);
+    if (strncmp((char *)s, rollfieldnames[i], *len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int parserollperiod(unsigned char c) {
+  int i;
+  for (i = 0; i < NUMROLLPERIODS; i++) {
+    if (c == rollperiods[i].letter) return i;
+  }
+  return -1;
+}
+
+/* Translates an outputformat into a list of fmtops. Returns 0 on success. */
+static int compilefmt(struct compiledfmt * cf, unsigned char * fmt) {
+  unsigned char * pos = fmt;
+  int fl = strlen((char *)fmt);
+  int nlits = 0;
+
+  /* Every op consumes at least one character of the format, and literal
+   * text never gets longer than the format either. */
+  cf->nops = 0;
+  cf->maxlen = 0;
+  cf->rollsecs = 0;
+  cf->ops = calloc(sizeof(struct fmtop), fl + 1);
+  cf->lits = calloc(1, fl + 1);
+  if ((cf->ops == NULL) || (cf->lits == NULL)) {
+    free(cf->ops); free(cf->lits);
+    cf->ops = NULL; cf->lits = NULL;
+    return -1;
+  }
+#define ADDLIT(c) \
+  do { \
+    if ((cf->nops == 0) || (cf->ops[cf->nops - 1].op != FOP_LITERAL)) { \
+      cf->ops[cf->nops].op = FOP_LITERAL; \
+      cf->ops[cf->nops].litoff = nlits; \
+      cf->ops[cf->nops].litlen = 0; \
+      cf->nops++; \
+    } \
+    cf->lits[nlits++] = (c); \
+    cf->ops[cf->nops - 1].litlen++; \
+    cf->maxlen++; \
+  } while (0)
+#define ADDOP(o) \
+  do { \
+    cf->ops[cf->nops].op = (o); \
+    cf->nops++; \
+    cf->maxlen += FOPMAXLEN; \
+  } while (0)
   while (*pos != 0) {
     if (*pos == '%') {
       pos++;
       if (*pos == '%') { /* literal percent sign */
-        *outbuf = '%';
-        outbuf++;
-      } else if ((*pos == 'B') || (*pos == 'b')) { /* barometric pressure */
-        if ((dd->lastseen + datavalidduration) < time(NULL)) { /* Stale data / no data yet */
-          outbuf += sprintf(outbuf, "%s", "N/A");
-        } else if (dd->lastpressure < 1.0) { /* Invalid / no pressure data available */
-          outbuf += sprintf(outbuf, "%s", "N/A");
-        } else if (*pos == 'B') {
-          outbuf += sprintf(outbuf, "%7.3lf", dd->lastpressure);
-        } else { /* 'b' */
-          outbuf += sprintf(outbuf, "%3.0lf", dd->lastpressure);
-        }
-      } else if ((*pos == 'C') || (*pos == 'c')) { /* CPM */
-        if ((dd->lastseen + datavalidduration) < time(NULL)) { /* Stale data / no data yet */
-          outbuf += sprintf(outbuf, "%s", "N/A");
-        } else if ((*pos == 'c') && (dd->lastcpm1 == 0xffffff)) {
-          outbuf += sprintf(outbuf, "%s", "N/A");
-        } else if ((*pos == 'C') && (dd->lastcpm60 == 0xffffff)) {
-          outbuf += sprintf(outbuf, "%s", "N/A");
-        } else {
-          outbuf += sprintf(outbuf, "%lu", (unsigned long)((*pos == 'c')
-                                           ? dd->lastcpm1
-                                           : dd->lastcpm60));
+        ADDLIT('%');
+      } else if (*pos == 'A') { /* Rollups: period, statistic, value */
+        int rp = -1, rf = -1, rl = 0;
+        if ((pos[1] != 0) && (pos[2] != 0) && (strchr("nxac", pos[2]) != NULL)) {
+          /* Upper case periods mean the last complete one */
+          rp = parserollperiod(tolower(pos[1]));
+          rf = parserollfield(&pos[3], &rl);
         }
-      } else if ((*pos == 'H') || (*pos == 'h')
-              || (*pos == 'F') || (*pos == 'f')) { /* Humidity */
-        if ((dd->lastseen + datavalidduration) < time(NULL)) { /* Stale data / no data yet */
-          outbuf += sprintf(outbuf, "%s", "N/A");
-        } else if (dd->lasthum == 106.0) { /* Invalid / no humidity sensor available */
-          outbuf += sprintf(outbuf, "%s", "N/A");
-        } else {
-          if (*pos == 'H') { /* fixed width, 2 digits after the comma */
-            outbuf += sprintf(outbuf, "%6.2lf", dd->lasthum);
-          } else if (*pos == 'h') { /* variable width, 2 digits after the comma. */
-            outbuf += sprintf(outbuf, "%.2lf", dd->lasthum);
-          } else if (*pos == 'F') { /* fixed width, 1 digit after the comma. */
-            outbuf += sprintf(outbuf, "%5.1lf", dd->lasthum);
-          } else if (*pos == 'f') { /* variable width, 1 digit after the comma. */
-            outbuf += sprintf(outbuf, "%.1lf", dd->lasthum);
+        if ((rp >= 0) && (rf >= 0)) {
+          cf->ops[cf->nops].rperiod = rp | (isupper(pos[1]) ? 0x80 : 0);
+          cf->ops[cf->nops].rstat = pos[2];
+          cf->ops[cf->nops].rfield = rf;
+          ADDOP(FOP_ROLLUP);
+          if ((cf->rollsecs == 0) || (rollperiods[rp].seconds < cf->rollsecs)) {
+            cf->rollsecs = rollperiods[rp].seconds;
           }
+          pos = pos + 2 + rl;
+        } else {
+          /* This is invalid but there isn't much we can do here. */
+          ADDLIT('A'); ADDLIT('?');
         }
+      } else if (*pos == 'B') { /* barometric pressure */
+        ADDOP(FOP_PRESSURE);
+      } else if (*pos == 'b') {
+        ADDOP(FOP_PRESSUREINT);
+      } else if (*pos == 'c') { /* CPM */
+        ADDOP(FOP_CPM1);
+      } else if (*pos == 'C') {
+        ADDOP(FOP_CPM60);
+      } else if (*pos == 'H') { /* Humidity, fixed width, 2 digits after the comma */
+        ADDOP(FOP_HUMFIX2);
+      } else if (*pos == 'h') { /* variable width, 2 digits after the comma. */
+        ADDOP(FOP_HUMVAR2);
+      } else if (*pos == 'F') { /* fixed width, 1 digit after the comma. */
+        ADDOP(FOP_HUMFIX1);
+      } else if (*pos == 'f') { /* variable width, 1 digit after the comma. */
+        ADDOP(FOP_HUMVAR1);
       } else if (*pos == 'L') { /* Last seen */
-        outbuf += sprintf(outbuf, "%u", (unsigned int)dd->lastseen);
+        ADDOP(FOP_LASTSEEN);
       } else if (*pos == 'n') { /* linefeed / Newline */
-        *outbuf = '\n';
-        outbuf++;
+        ADDLIT('\n');
       } else if ((*pos == 'P') || (*pos == 'p')) { /* PM (particulate matter) */
-        if (strncmp(pos + 1, "M2.5u", 5) == 0) {
+        if (strncmp((char *)pos + 1, "M2.5u", 5) == 0) {
           pos = pos + 5;
-          outbuf += sprintf(outbuf, "%.1lf", dd->lastpm2_5);
-        } else if (strncmp(pos + 1, "M10u", 4) == 0) {
+          ADDOP(FOP_PM2_5);
+        } else if (strncmp((char *)pos + 1, "M10u", 4) == 0) {
           pos = pos + 4;
-          outbuf += sprintf(outbuf, "%.1lf", dd->lastpm10);
+          ADDOP(FOP_PM10);
         } else {
           /* This is invalid but there isn't much we can do here. */
-          outbuf += sprintf(outbuf, "%s", "P?");
+          ADDLIT('P'); ADDLIT('?');
         }
       } else if (*pos == 'r') { /* carriage return */
-        *outbuf = '\r';
-        outbuf++;
+        ADDLIT('\r');
       } else if (*pos == 'R') { /* Rain sensors */
-        if (strncmp(pos + 1, "R", 1) == 0) { /* Rain rate */
+        if (pos[1] == 'R') { /* Rain rate */
           pos = pos + 1;
-          if (((dd->lastseen + datavalidduration) < time(NULL))
-           || (dd->lastrainrate <= -1.0)) { /* Stale data / no data yet */
-            outbuf += sprintf(outbuf, "%s", "N/A");
-          } else {
-            outbuf += sprintf(outbuf, "%.2lf", dd->lastrainrate);
-          }
-        } else if (strncmp(pos + 1, "T", 1) == 0) { /* Rain tip counter */
+          ADDOP(FOP_RAINRATE);
+        } else if (pos[1] == 'T') { /* Rain tip counter */
           pos = pos + 1;
-          if (((dd->lastseen + datavalidduration) < time(NULL))
-           || (dd->lastraintipcount == 0xffffffff)) { /* Stale data / no data yet */
-            outbuf += sprintf(outbuf, "%s", "N/A");
-          } else {
-            outbuf += sprintf(outbuf, "%lu", (unsigned long)dd->lastraintipcount);
-          }
+          ADDOP(FOP_RAINTIPS);
         } else {
           /* This is invalid but there isn't much we can do here. */
-          outbuf += sprintf(outbuf, "%s", "R?");
+          ADDLIT('R'); ADDLIT('?');
         }
       } else if (*pos == 'S') { /* SensorID */
-        outbuf += sprintf(outbuf, "0x%02x", dd->sensorid);
-      } else if ((*pos == 'T') || (*pos == 't')) { /* Temperature */
-        if (((dd->lastseen + datavalidduration) < time(NULL))
-         || (dd->lasttemp <= -274.0)) { /* Stale data / no data yet */
-          outbuf += sprintf(outbuf, "%s", "N/A");
-        } else {
-          if (*pos == 'T') { /* fixed width */
-            outbuf += sprintf(outbuf, "%6.2lf", dd->lasttemp);
-          } else { /* variable width. */
-            outbuf += sprintf(outbuf, "%.2lf", dd->lasttemp);
-          }
-        }
+        ADDOP(FOP_SENSORID);
+      } else if (*pos == 'T') { /* Temperature, fixed width */
+        ADDOP(FOP_TEMPFIX);
+      } else if (*pos == 't') { /* variable width. */
+        ADDOP(FOP_TEMPVAR);
       } else if (*pos == 'U') { /* UV- or solar intensity */
-        if (strncmp(pos + 1, "V", 1) == 0) {
+        if (pos[1] == 'V') {
           pos = pos + 1;
-          if (((dd->lastseen + datavalidduration) < time(NULL))
-           || (dd->lastuv <= -1.0)) { /* Stale data / no data yet */
-            outbuf += sprintf(outbuf, "%s", "N/A");
-          } else {
-            outbuf += sprintf(outbuf, "%.2lf", dd->lastuv);
-          }
-        } else if (strncmp(pos + 1, "I", 1) == 0) {
+          ADDOP(FOP_UV);
+        } else if (pos[1] == 'I') {
           pos = pos + 1;
-          if (((dd->lastseen + datavalidduration) < time(NULL))
-           || (dd->lastsolar <= -1.0)) { /* Stale data / no data yet */
-            outbuf += sprintf(outbuf, "%s", "N/A");
-          } else {
-            outbuf += sprintf(outbuf, "%.2lf", dd->lastsolar);
-          }
+          ADDOP(FOP_SOLAR);
         } else {
           /* This is invalid but there isn't much we can do here. */
-          outbuf += sprintf(outbuf, "%s", "U?");
+          ADDLIT('U'); ADDLIT('?');
         }
       } else if ((*pos == 'V') || (*pos == 'v')) { /* Voltage */
-        if ((dd->lastseen + datavalidduration) < time(NULL)) { /* Stale data / no data yet */
-          outbuf += sprintf(outbuf, "%s", "N/A");
-        } else {
-          outbuf += sprintf(outbuf, "%4.2lf", dd->lastvoltage);
-        }
+        ADDOP(FOP_VOLTAGE);
       } else if (*pos == 0) {
-        *outbuf = 0;
-        return;
+        break;
       }
       pos++;
     } else {
-      *outbuf = *pos;
-      outbuf++;
+      ADDLIT(*pos);
       pos++;
     }
   }
-  *outbuf = 0;
+#undef ADDLIT
+#undef ADDOP
+  return 0;
 }
 
-static void dotryrestart(struct daemondata * dd, char ** argv, int serialfd) {
-  struct daemondata * curdd = dd;
+static void freecompiledfmt(struct compiledfmt * cf) {
+  free(cf->ops);
+  free(cf->lits);
+  cf->ops = NULL;
+  cf->lits = NULL;
+  cf->nops = 0;
+}
 
-  if (!restartonerror) {
-    exit(1);
-  }
-  /* close all open sockets */
-  close(serialfd);
-  while (curdd != NULL) {
-    close(curdd->fd);
-    curdd = curdd->next;
+/* snprintf that returns what was actually written, not what would have
+ * been written if there had been enough space. */
+static int bprintf(char * buf, int space, const char * fmt, ...) {
+  va_list ap;
+  int r;
+  if (space <= 0) return 0;
+  va_start(ap, fmt);
+  r = vsnprintf(buf, space + 1, fmt, ap);
+  va_end(ap);
+  if (r < 0) return 0;
+  return (r > space) ? space : r;
+}
+
+/* Returns the bucket of period rp that was current back buckets before
+ * time t, or NULL if we have no data for it. */
+static struct rollbucket * getrollbucket(struct sensorstate * ss, int rp,
+                                         int back, time_t t) {
+  struct rollbucket * rb;
+  uint32_t start = (t / rollperiods[rp].seconds) - back;
+
+  if (ss->rollups[rp] == NULL) return NULL;
+  rb = &ss->rollups[rp][start % rollperiods[rp].nbuckets];
+  return (rb->start == start) ? rb : NULL;
+}
+
+static struct rollfield * getrollfield(struct sensorstate * ss, int rp,
+                                       int back, int field, time_t t) {
+  struct rollbucket * rb = getrollbucket(ss, rp, back, t);
+  if ((rb == NULL) || (rb->f[field].count == 0)) return NULL;
+  return &rb->f[field];
+}
+
+/* A sensor counts as gone after it missed this many transmissions in a
+ * row. Our sensors send every 24 or 32 seconds, LaCrosse ones every 4, so
+ * the time this takes differs a lot between them. It never gets shorter
+ * than VALIDMINDURATION though, so jitter cannot make a fast sensor flap. */
+#define VALIDMISSES 4
+#define VALIDMINDURATION 15
+#define GAPSTOLEARN 4
+
+/* Returns the last second in which the data of ss is still valid. */
+static time_t validuntil(struct sensorstate * ss) {
+  time_t d;
+
+  if (ss->interval == 0) {
+    return ss->lastseen + datavalidduration;
   }
-  fprintf(stderr, "Will try to restart in %d second(s)...\n", restartonerror);
-  sleep(restartonerror);
-  execv(argv[0], argv);
-  exit(1); /* This should never be reached, but just to be sure in case the exec fails... */
+  d = ss->interval * VALIDMISSES;
+  if (d < VALIDMINDURATION) d = VALIDMINDURATION;
+  return ss->lastseen + d;
 }
 
-/* Calculate LaCrosse (compatible) CRC. Taken from LaCrosseITPlusReader. */
-static uint8_t lcccrc(uint8_t * data, int len) {
+/* Sets interval and longestgap of ss from the gaps it has seen. */
+static void learninterval(struct sensorstate * ss) {
+  uint16_t sorted[NUMGAPS];
   int i, j;
-  uint8_t res = 0;
-  for (j = 0; j < len; j++) {
-    uint8_t val = data[j];
-    for (i = 0; i < 8; i++) {
-      uint8_t tmp = (uint8_t)((res ^ val) & 0x80);
-      res <<= 1;
-      if (0 != tmp) {
-        res ^= 0x31;
-      }
-      val <<= 1;
+
+  ss->interval = 0;
+  ss->longestgap = 0;
+  if (ss->ngaps < GAPSTOLEARN) return;
+  for (i = 0; i < ss->ngaps; i++) {
+    uint16_t v = ss->gaps[i];
+    for (j = i; (j > 0) && (sorted[j - 1] > v); j--) {
+      sorted[j] = sorted[j - 1];
     }
+    sorted[j] = v;
+  }
+  /* The median is not thrown off by the occasional lost frame. But our
+   * sensors alternate between sending after 24 and after 32 seconds, and
+   * the median lands on one of the two, so everything up to 1.5 times
+   * the median still counts as a regular gap. */
+  ss->interval = sorted[ss->ngaps / 2];
+  for (i = ss->ngaps / 2; (i < ss->ngaps) && ((sorted[i] * 2) <= (ss->interval * 3)); i++) {
+    ss->longestgap = sorted[i];
   }
-  return res;
 }
 
-#define LLSIZE 1000
-static void parseserialline(unsigned char * origlastline, struct daemondata * dd) {
-  unsigned char lastline[LLSIZE];
-  unsigned char isok[LLSIZE];
-  unsigned char rtype[LLSIZE];
-  unsigned int sid;
-  unsigned char stype = 0;
-  unsigned int parsed[14];
-  int ret;
-  struct daemondata * curdd;
-  double newtemp = -274.0, newvolt = 0.0;
-  double newhum = 106.0; /* LaCrosse sensors use 106 to show they have no
-                          * humidity data, so we just recycle that */
-  double newpress = -1.0, newpm2_5 = -1.0, newpm10 = -1.0;
-  double newsolar = -1.0, newuv = -1.0;
-  double newrainrate = -1.0; uint32_t newraintipcount = 0xffffffff;
-  uint32_t newcpm1 = 0xffffff, newcpm60 = 0xffffff;
-  
-  strcpy(lastline, origlastline); /* Just so we don't modify the original string */
-  if (receivertype == RECTJEELDAVISV) { /* JeeLink with DavisVantage receiver firmware */
-    /* This differs in almost every aspect from our other receivers and sensors,
-     * so gets its own implementation. */
-    unsigned char ps1[LLSIZE];
-    unsigned char ps2[LLSIZE];
-    unsigned char bigvstr[LLSIZE];
-    unsigned char ps3[LLSIZE];
-    char * saveptr;
-    char * nextpart;
-    // Example string:
-    // OK VALUES DAVIS 5 Channel=1,RSSI=-59,Battery=ok,WindSpeed=0.00,WindDirection=0,Humidity=87.00,
-    ret = sscanf(lastline, "%s %s %s %u %s %s",
-                           &isok[0], &ps1[0], &ps2[0], &sid, &bigvstr[0], &ps3[0]);
-    if (ret != 5) return;
-    if (strcmp(isok, "OK")) return;
-    if (strcmp(ps1, "VALUES")) return;
-    if (strcmp(ps2, "DAVIS")) return;
-    stype = 'V';
-    VERBPRINT(1, "Received data from D-sensor %u:", sid);
-    /* now the actual real parsing starts: We need to split the long string */
-    nextpart = strtok_r(bigvstr, ",", &saveptr);
-    while (nextpart != NULL) {
-      char * ks; char * vs; char * savep2;
-      ks = strtok_r(nextpart, "=", &savep2);
-      if (ks != NULL) {
-        vs = strtok_r(NULL, "=", &savep2);
-        if (vs != NULL) {
-          VERBPRINT(4, " [%s = %s]", ks, vs);
-          if        (strcmp(ks, "Temperature") == 0) {
-            newtemp = strtod(vs, NULL);
-            VERBPRINT(1, " t=%.2lf,", newtemp);
-          } else if (strcmp(ks, "Humidity") == 0) {
-            newhum = strtod(vs, NULL);
-            VERBPRINT(1, " h=%.2lf,", newhum);
-          } else if (strcmp(ks, "UV") == 0) {
-            /* The firmware seems to do quite a bit of nonsense here.
-             * It will subtract 1 unconditionally, so seeing '-1' is
-             * perfectly normal, it can just mean there is no sun.
-             * You can get the "UV index" value from this by dividing
-             * through 50. */
-            newuv = (strtod(vs, NULL) + 1.0) / 50.0;
-            VERBPRINT(1, " uv=%.2lf,", newuv);
-          } else if (strcmp(ks, "Solar") == 0) {
-            newsolar = strtod(vs, NULL) + 1.0; // in W per m^2
-            VERBPRINT(1, " solint=%.2lf,", newsolar);
-          } else if (strcmp(ks, "WindSpeed") == 0) {
-            /* not implemented */
-            /* our weather station does not have the wind vane so we cannot test. */
-          } else if (strcmp(ks, "WindDirection") == 0) {
-            /* not implemented */
-            /* our weather station does not have the wind vane so we cannot test. */
-          } else if (strcmp(ks, "RainSecs") == 0) {
-            /* This is 'seconds between tips' of the bucket. The bucket seems
-             * to be differently sized in NorthAmerica (0.01 inch) and Europe
-             * (0.02mm). We just assume the european version here. */
-            double sbt = strtod(vs, NULL);
-            if (sbt < 0.0) { /* the firmware _should_ report -1 on error */
-              newrainrate = -1.0;
-            } else {
-              /* calculate mm per hour. 0.02mm is the tip size. */
-              newrainrate = (3600 * 0.02) / sbt;
-            }
-            VERBPRINT(1, " rainrate=%.2lf,", newrainrate);
-          } else if (strcmp(ks, "RainTipCount") == 0) {
-            /* This is simply a 7 bit counter that counts up with every bucket
-             * tip, meaning it reverts back to 0 after 127. */
-            newraintipcount = strtoul(vs, NULL, 10);
-            VERBPRINT(1, " raintipctr=%lu,", (unsigned long)newraintipcount);
-          } else if (strcmp(ks, "Battery") == 0) {
-            if (strcmp(vs, "ok") == 0) { /* These are the same fake voltage */
-              newvolt = 2.5; /* values we use for the lacrosse sensors, that */
-            } else {         /* also only have a ok / bad state and no real */
-              newvolt = 1.0; /* battery voltage measurement */
-            }
-            VERBPRINT(1, " v=%.2lf,", newvolt);
-          } else if (strcmp(ks, "Channel") == 0) {
-            /* Useless for us */
-          } else if (strcmp(ks, "RSSI") == 0) {
-            /* Useless for us */
-          } else {
-            VERBPRINT(2, " unknown:%s=%s,", ks, vs);
-          }
-        }
-      }
-      nextpart = strtok_r(NULL, ",", &saveptr);
-    }
-    VERBPRINT(1, "\n");
-  } else { /* normal JeeLink OR CUL */
-    if (receivertype == RECTCUL) {
-      uint8_t rawbytes[LLSIZE];
-      int ppos;
-      /* Instead of implementing all the logic below twice, we convert the
-       * raw format from the CUL into the preprocessed format a Jeelink would
-       * deliver. Waaaaaay less work. */
-      /* Example strings the receiver may spit out:
-       * N02CC3A06F7604A9332EC0A04F6CCAB4D3058D5C5769932D398 (not with default culfw)
-       * N019CC4503651AAAA000381FFEB (default culfw, at most 12 bytes data) */
-      if ((strncmp(&origlastline[0], "N01", 3) != 0)
-       && (strncmp(&origlastline[0], "N02", 3) != 0)) {
-        return; /* Not a string containing a raw packet */
-      }
-      ppos = 0;
-      while (strlen(&origlastline[3 + ppos * 2]) >= 2) {
-        ret = sscanf(&origlastline[3 + ppos * 2], "%02hhx", &rawbytes[ppos]);
-        if (ret != 1) return; /* non-hex stuff - invalid data */
-        ppos++;
-      }
-      if (ppos < 6) return; /* This cannot be valid, it's too short */
-      if (rawbytes[0] == 0xcc) { /* "Custom" sensor */
-        /* Format: SSSSSSSS  IIIIIIII  BBBBBBBB  DDDDDDDD [...] DDDDDDDD  CCCCCCCC */
-        int i;
-        int datalen = rawbytes[2];
-        if ((datalen+3) >= ppos) { /* This is not long enough */
-          if (ppos == 12) {
-            /* By default, culfw only receives up to 12 bytes long packets.
-             * To fix this, you need to modify the file clib/rf_native.c in culfw
-             * and increase CC1100_FIFOTHR from the default 2 to at least 4 (=20
-             * bytes RX FIFO, that still leaves 45 bytes for the TX FIFO), then
-             * recompile the fw and reflash your CUL. */
-            VERBPRINT(3, "Discarding received custom sensor packet - claimed data"
-                         " length %d is too long for packet length %d. Note: this"
-                         " might be caused by a default culfw limitation.\n",
-                         datalen, ppos);
-          } else {
-            VERBPRINT(3, "Discarding received custom sensor packet - claimed data"
-                         " length %d is too long for packet length %d\n",
-                         datalen, ppos);
-          }
-          return;
-        }
-        if (lcccrc(&rawbytes[0], datalen + 3) != rawbytes[datalen + 3]) { /* bad CRC */
-          VERBPRINT(3, "Discarding received custom sensor packet due to CRC fail\n");
-          return;
-        }
-        sprintf(lastline, "OK CC %u", rawbytes[1]);
-        for (i = 0; i < datalen; i++) {
-          unsigned char decspf[10];
-          sprintf(decspf, " %u", rawbytes[i+3]);
-          strcat(lastline, decspf);
-        }
-      } else if ((rawbytes[0] & 0xf0) == 0x90) { /* "LaCrosse" sensor */
-        /* Packets are always 5 bytes, and thanks to LaCrosseITPlusReader we
-         * know the format: SSSS.DDDD DDN_.TTTT TTTT.TTTT WHHH.HHHH CCCC.CCCC
-         * (see LaCrosseITPlusReader for detailed explanation) */
-        unsigned int rtemp;
-        sid = ((rawbytes[0] & 0x0f) << 2) | (rawbytes[1] >> 6);
-        /* Check CRC */
-        if (lcccrc(&rawbytes[0], 4) != rawbytes[4]) { /* bad CRC */
-          VERBPRINT(3, "Discarding received LaCrosse sensor data due to CRC fail\n");
-          return;
-        }
-        /* Temp is BCD (binary coded decimal) which is not nice to process :-/ */
-        /* On the other hand, it permits us to do some more sanity checks,
-         * hopefully catching more errors that the CRC did not */
-        if (((rawbytes[2] >> 4) >= 10) || ((rawbytes[2] & 0x0f) >= 10)) {
-          VERBPRINT(3, "Discarding received LaCrosse sensor data due to invalid BCD data\n");
-          return;
-        }
-        rtemp = (rawbytes[1] & 0x0f) * 100;
-        rtemp += (rawbytes[2] >> 4) * 10;
-        rtemp += (rawbytes[2] & 0x0f);
-        /* the format received from the sensor is (temp - 40.0), what goes out in
-         * the JeeLink packet is (temp + 100.0) instead. Why? I have no clue. */
-        rtemp += 600; /* 100 - 40 */
-        sprintf(lastline, "OK 9 %u %u %u %u %u",
-                          sid,
-                          ((rawbytes[1] & 0x20) == 0x20) ? 129 : 1, /* this would also encode a sensor type, but we don't parse that below anyways */
-                          (rtemp >> 8),
-                          (rtemp & 0xff),
-                          rawbytes[3]);
-      } else { /* not a known sensor type */
-        return;
-      }
+/* Learns from the time between the previous and the current frame of ss how
+ * often it sends, and how many transmissions in between were lost. */
+static void addgap(struct sensorstate * ss, time_t now) {
+  time_t gap, n;
+
+  if (ss->lastseen == 0) return;
+  gap = now - ss->lastseen;
+  if (gap <= 0) return; /* parts of the same transmission (Davis) */
+  if ((ss->longestgap != 0) && ((gap * 2) > (ss->longestgap * 3))) {
+    /* Anything that took about n of the longest regular gaps means n-1
+     * were lost. Measured against a shorter one, a sensor alternating
+     * between two intervals would seem to lose more than it does. */
+    n = (gap + (ss->longestgap / 2)) / ss->longestgap;
+    ss->nmissed += n - 1;
+  }
+  ss->gaps[ss->gappos] = (gap > 0xffff) ? 0xffff : gap;
+  ss->gappos = (ss->gappos + 1) % NUMGAPS;
+  if (ss->ngaps < NUMGAPS) ss->ngaps++;
+  learninterval(ss);
+}
+
+/* Renders a compiled outputformat with the values from ss, as they were
+ * valid at time now. Output is cut off at oblen - 1 characters and always
+ * 0-terminated. Returns the length of the output. */
+static int renderfmt(char * outbuf, int oblen, struct compiledfmt * cf,
+                     struct sensorstate * ss, time_t now) {
+  int i;
+  int pos = 0;
+  int space;
+  int stale = (validuntil(ss) < now); /* Stale data / no data yet */
+
+  if (oblen <= 0) return 0;
+  oblen--; /* leave room for the terminating 0 */
+  for (i = 0; (i < cf->nops) && (pos < oblen); i++) {
+    struct fmtop * op = &cf->ops[i];
+    char * o = &outbuf[pos];
+    space = oblen - pos;
+    if ((op->op != FOP_LITERAL) && (space > FOPMAXLEN)) {
+      space = FOPMAXLEN;
     }
-    /* OK CC 7 23 144 34 53 133                           hawotempdev2016 length=8 */
-    /* OK CC 8 247 98 194 159 169 198                     foxtempdev2016  length=9 */
-    /* OK 9 9 1 4 194 32                                  lacrosse        length=7 */
-    /* OK CC 7 245 1 151 87 51 120 96 97 0 33 0 95 0      foxstaub2018    length=16 */
-    /* OK CC 2 249 0 0 34 0 0 26 157                      foxgeig2018     length=11 */
-    /* OK CC 7 253 99 175 152 104 230 119 60 62           hawotempdev2018 length=12 */
-    ret = sscanf(lastline, "%s %s %u %u %u %u %u %u %u %u %u %u %u %u %u %u %u",
-                           &isok[0], &rtype[0], &sid, &parsed[0], &parsed[1],
-                           &parsed[2], &parsed[3], &parsed[4], &parsed[5], &parsed[6],
-                           &parsed[7], &parsed[8], &parsed[9], &parsed[10], &parsed[11],
-                           &parsed[12], &parsed[13]);
-    if ((ret != 7) && (ret != 8) && (ret != 9) && (ret != 11) && (ret != 12) && (ret != 16)) return;
-    if (strcmp(isok, "OK")) return;
-    if ((strcmp(rtype, "CC") == 0) && (ret == 8)) { /* hawotempdev2016 */
-      stype = 'H';
-      if ((parsed[0] == 0xff) && (parsed[1] == 0xff)) {
-        /* Sensor reported invalid data on the device. */
+    switch (op->op) {
+    case FOP_LITERAL:
+      if (space > op->litlen) space = op->litlen;
+      memcpy(o, &cf->lits[op->litoff], space);
+      pos += space;
+      break;
+    case FOP_PRESSURE:
+    case FOP_PRESSUREINT:
+      if ((stale) || (ss->last.pressure < 1.0)) { /* Invalid / no pressure data available */
+        pos += bprintf(o, space, "%s", "N/A");
+      } else if (op->op == FOP_PRESSURE) {
+        pos += bprintf(o, space, "%7.3lf", ss->last.pressure);
+      } else {
+        pos += bprintf(o, space, "%3.0lf", ss->last.pressure);
+      }
+      break;
+    case FOP_CPM1:
+      if ((stale) || (ss->last.cpm1 == 0xffffff)) {
+        pos += bprintf(o, space, "%s", "N/A");
       } else {
-        newtemp = ((165.0 / 16383.0) * (double)(((parsed[0] & 0x3f) << 8) | parsed[1])) - 40.0;
-      }
-      newhum = (100.0 / 16383.0) * (double)((parsed[2] << 8) | parsed[3]);
-      newvolt = 3.0 * (parsed[4] / 255.0);
-      VERBPRINT(1, "Received data from H-sensor %u: t=%.2lf h=%.2lf v=%.2lf\n",
-                   sid, newtemp, newhum, newvolt);
-    } else if ((strcmp(rtype, "CC") == 0) && (ret == 9)) { /* foxtempdev2016 */
-      if (parsed[0] != 0xf7)  return; /* 'subtype' is not foxtemp (0xf7) */
-      stype = 'F';
-      newtemp = (-45.00 + 175.0 * ((double)((parsed[1] << 8) | parsed[2]) / 65535.0));
-      newhum = (100.0 * ((double)((parsed[3] << 8) | parsed[4]) / 65535.0));
-      newvolt = (3.3 * parsed[5]) / 255.0;
-      VERBPRINT(1, "Received data from F-sensor %u: t=%.2lf h=%.2lf v=%.2lf\n",
-                   sid, newtemp, newhum, newvolt);
-    } else if ((strcmp(rtype, "CC") == 0) && (ret == 11)) { /* foxgeig2018 */
-      if (parsed[0] != 0xf9)  return; /* 'subtype' is not foxgeig (0xf9) */
-      stype = 'G';
-      newcpm1 = ((uint32_t)parsed[1] << 16) | ((uint32_t)parsed[2] << 8)
-              | ((uint32_t)parsed[3]);
-      newcpm60 = ((uint32_t)parsed[4] << 16) | ((uint32_t)parsed[5] << 8)
-               | ((uint32_t)parsed[6]);
-      newvolt = 6.6 * (parsed[7] / 255.0);
-      VERBPRINT(1, "Received data from G-sensor %u: cpm1=%lu cpm60=%lu v=%.2lf\n",
-                   sid, (unsigned long)newcpm1, (unsigned long)newcpm60, newvolt);
-    } else if ((strcmp(rtype, "CC") == 0) && (ret == 12)) { /* hawotempdev2018 / foxtempdev with pressure sensor */
-      uint32_t newpraw;
-      if (parsed[0] != 0xfd)  return; /* 'subtype' is not hawotempdev2018 (0xfd) */
-      stype = 'D';
-      newtemp = (-45.00 + 175.0 * ((double)((parsed[1] << 8) | parsed[2]) / 65535.0));
-      newhum = (100.0 * ((double)((parsed[3] << 8) | parsed[4]) / 65535.0));
-      newvolt = (3.3 * parsed[5]) / 255.0;
-      newpraw = (((uint32_t)parsed[8] << 16) | ((uint32_t)parsed[7] <<  8)
-               | ((uint32_t)parsed[6] <<  0));
-      newpress = (double)newpraw / 4096.0;
-      VERBPRINT(1, "Received data from D-sensor %u: t=%.2lf h=%.2lf v=%.2lf p=%.3lf\n",
-                   sid, newtemp, newhum, newvolt, newpress);
-    } else if ((strcmp(rtype, "CC") == 0) && (ret == 16)) { /* foxstaub2018, 2022 edition */
-      uint32_t newpraw;
-      if (parsed[0] != 0xf5)  return; /* 'subtype' is not foxstaub (0xf5) */
-      stype = 'S';
-      newpraw = (((uint32_t)parsed[1] << 16) | ((uint32_t)parsed[2] <<  8)
-               | ((uint32_t)parsed[3] <<  0));
-      if (newpraw != 0xffffff) {
-        newpress = (double)newpraw / 4096.0;
-      }
-      if ((parsed[4] != 0xff) || (parsed[5] != 0xff)) {
-        newtemp = (-45.00 + 175.0 * ((double)((parsed[4] << 8) | parsed[5]) / 65535.0));
-        newhum = (100.0 * ((double)((parsed[6] << 8) | parsed[7]) / 65535.0));
-      }
-      newpm2_5 = ((double)((parsed[8] << 8) | parsed[9])) / 10.0;
-      newpm10 = ((double)((parsed[10] << 8) | parsed[11])) / 10.0;
-      /* Voltage is a bit complicated: reference voltage is set to 2.56V,
-       * so 255 == 2.56V at the ADC pin. The ADC pin however is connected
-       * through a 10M/1M voltage divider, so 1V at the ADC pin is actually
-       * 11V at the battery. */
-      newvolt = ((double)parsed[12] / 100.0) * 11.0;
-      VERBPRINT(1, "Received data from S-sensor %u: t=%.2lf h=%.2lf p=%.3lf pm2_5=%.1lf pm10=%.1lf v=%.2lf\n",
-                   sid, newtemp, newhum, newpress, newpm2_5, newpm10, newvolt);
-    } else if ((strcmp(rtype, "9") == 0) && (ret == 7)) { /* cheap lacrosse */
-      stype = 'L';
-      newtemp = ((double)((parsed[1] << 8) | parsed[2]) - 1000.0) / 10.0;
-      newhum = (double)(parsed[3] & 0x7f);
-      if ((parsed[3] & 0x80)) { /* There is no real voltage measurement available */
-        newvolt = 1.0;          /* just a weak battery flag. We take a weak */
-      } else {                  /* battery as having 1.0 volt and everything else */
-        newvolt = 2.5;          /* as having 2.5 volt. */
-      }
-      if (newhum == 106.0) { /* has no humidity sensor */
-        VERBPRINT(1, "Received data from L-sensor %u: t=%.2lf NOHUMSENS%s%s\n",
-                     sid, newtemp,
-                     ((parsed[0] & 0x80) ? " NEWBATT" : ""),
-                     ((parsed[3] & 0x80) ? " WEAKBATT" : ""));
+        pos += bprintf(o, space, "%lu", (unsigned long)ss->last.cpm1);
+      }
+      break;
+    case FOP_CPM60:
+      if ((stale) || (ss->last.cpm60 == 0xffffff)) {
+        pos += bprintf(o, space, "%s", "N/A");
       } else {
-        VERBPRINT(1, "Received data from L-sensor %u: t=%.2lf h=%.2lf%s%s\n",
-                     sid, newtemp, newhum,
-                     ((parsed[0] & 0x80) ? " NEWBATT" : ""),
-                     ((parsed[3] & 0x80) ? " WEAKBATT" : ""));
+        pos += bprintf(o, space, "%lu", (unsigned long)ss->last.cpm60);
       }
-    } else {
-      return; /* Not a known/supported sensor */
-    }
-  } /* Normal JeeLink or CUL */
-  curdd = dd;
-  while (curdd != NULL) {
-    if ((curdd->sensortype == stype)
-     && (curdd->sensorid == sid)) { /* This sensor type+ID is requested */
-      curdd->lastseen = time(NULL);
-      /* We need special handling for the davis here, as it does not transmit
-       * all values at the same time. So for the davis, only update those values
-       * that were really transmitted. */
-      if ((curdd->sensortype != 'V') || (newtemp > -274.0)) {
-        curdd->lasttemp = newtemp;
+      break;
+    case FOP_HUMFIX2:
+    case FOP_HUMVAR2:
+    case FOP_HUMFIX1:
+    case FOP_HUMVAR1:
+      if ((stale) || (ss->last.hum == 106.0)) { /* Invalid / no humidity sensor available */
+        pos += bprintf(o, space, "%s", "N/A");
+      } else if (op->op == FOP_HUMFIX2) {
+        pos += bprintf(o, space, "%6.2lf", ss->last.hum);
+      } else if (op->op == FOP_HUMVAR2) {
+        pos += bprintf(o, space, "%.2lf", ss->last.hum);
+      } else if (op->op == FOP_HUMFIX1) {
+        pos += bprintf(o, space, "%5.1lf", ss->last.hum);
+      } else {
+        pos += bprintf(o, space, "%.1lf", ss->last.hum);
       }
-      if ((curdd->sensortype != 'V') || (newhum != 106.0)) {
-        curdd->lasthum = newhum;
+      break;
+    case FOP_LASTSEEN:
+      pos += bprintf(o, space, "%u", (unsigned int)ss->lastseen);
+      break;
+    case FOP_PM2_5:
+      pos += bprintf(o, space, "%.1lf", ss->last.pm2_5);
+      break;
+    case FOP_PM10:
+      pos += bprintf(o, space, "%.1lf", ss->last.pm10);
+      break;
+    case FOP_RAINRATE:
+      if ((stale) || (ss->last.rainrate <= -1.0)) {
+        pos += bprintf(o, space, "%s", "N/A");
+      } else {
+        pos += bprintf(o, space, "%.2lf", ss->last.rainrate);
       }
-      if ((curdd->sensortype != 'V') || (newvolt > 0.0)) {
-        curdd->lastvoltage = newvolt;
+      break;
+    case FOP_RAINTIPS:
+      if ((stale) || (ss->last.raintipcount == 0xffffffff)) {
+        pos += bprintf(o, space, "%s", "N/A");
+      } else {
+        pos += bprintf(o, space, "%lu", (unsigned long)ss->last.raintipcount);
       }
-      if ((curdd->sensortype != 'V') || (newpress > -1.0)) {
-        curdd->lastpressure = newpress;
+      break;
+    case FOP_SENSORID:
+      pos += bprintf(o, space, "0x%02x", ss->sensorid);
+      break;
+    case FOP_TEMPFIX:
+    case FOP_TEMPVAR:
+      if ((stale) || (ss->last.temp <= -274.0)) {
+        pos += bprintf(o, space, "%s", "N/A");
+      } else if (op->op == FOP_TEMPFIX) {
+        pos += bprintf(o, space, "%6.2lf", ss->last.temp);
+      } else {
+        pos += bprintf(o, space, "%.2lf", ss->last.temp);
       }
-      curdd->lastpm2_5 = newpm2_5;
-      curdd->lastpm10 = newpm10;
-      if ((curdd->sensortype != 'V') || (newsolar > -1.0)) {
-        curdd->lastsolar = newsolar;
+      break;
+    case FOP_UV:
+      if ((stale) || (ss->last.uv <= -1.0)) {
+        pos += bprintf(o, space, "%s", "N/A");
+      } else {
+        pos += bprintf(o, space, "%.2lf", ss->last.uv);
       }
-      if ((curdd->sensortype != 'V') || (newuv > -1.0)) {
-        curdd->lastuv = newuv;
+      break;
+    case FOP_SOLAR:
+      if ((stale) || (ss->last.solar <= -1.0)) {
+        pos += bprintf(o, space, "%s", "N/A");
+      } else {
+        pos += bprintf(o, space, "%.2lf", ss->last.solar);
       }
-      if ((curdd->sensortype != 'V') || (newrainrate > -1.0)) {
-        curdd->lastrainrate = newrainrate;
+      break;
+    case FOP_VOLTAGE:
+      if (stale) {
+        pos += bprintf(o, space, "%s", "N/A");
+      } else {
+        pos += bprintf(o, space, "%4.2lf", ss->last.voltage);
       }
-      curdd->lastcpm1 = newcpm1;
-      curdd->lastcpm60 = newcpm60;
-      if ((curdd->sensortype != 'V') || (newraintipcount != 0xffffffff)) {
-        curdd->lastraintipcount = newraintipcount;
+      break;
+    case FOP_ROLLUP:
+      {
+        struct rollfield * rf = getrollfield(ss, op->rperiod & 0x7f,
+                                             (op->rperiod & 0x80) ? 1 : 0,
+                                             op->rfield, now);
+        if (rf == NULL) {
+          pos += bprintf(o, space, "%s", "N/A");
+        } else if (op->rstat == 'c') {
+          pos += bprintf(o, space, "%lu", (unsigned long)rf->count);
+        } else {
+          pos += bprintf(o, space, "%.2lf", (op->rstat == 'n') ? rf->min
+                         : ((op->rstat == 'x') ? rf->max : (rf->sum / rf->count)));
+        }
       }
-    }
-    curdd = curdd->next;
+      break;
+    };
   }
+  outbuf[pos] = 0;
+  return pos;
 }
 
-static int processserialdata(int serialfd, struct daemondata * dd, char ** argv, char * jlinitstr) {
-  static unsigned char lastline[LLSIZE];
-  static unsigned int llpos = 0;
-  static time_t lastsentinit = 0;
-  unsigned char buf[100];
-  int ret; int i;
-
-  /* Init lastsentinit if not done yet */
-  if (lastsentinit == 0) {
-    lastsentinit = time(NULL);
+static void updatecachedout(struct daemondata * dd, time_t now) {
+  dd->cachedlen = renderfmt(dd->cachedout, sizeof(dd->cachedout),
+                            &dd->cfmt, dd->ss, now);
+  if (validuntil(dd->ss) < now) {
+    dd->cacheexpires = 0;
+  } else {
+    dd->cacheexpires = validuntil(dd->ss) + 1;
   }
-  ret = read(serialfd, buf, sizeof(buf));
-  if (ret < 0) {
-    fprintf(stderr, "unexpected ERROR reading serial input: %s\n", strerror(errno));
-    dotryrestart(dd, argv, serialfd);
-  }
-  for (i = 0; i < ret; i++) {
-    if ((buf[i] == '\n') || (buf[i] == '\r')
-     || (buf[i] == 0) || (llpos >= (LLSIZE - 10))) { /* Line complete. process it. */
-      if (llpos > 0) {
-        lastline[llpos] = 0;
-        VERBPRINT(2, "Received on serial: %s\n", lastline);
-        if (strncmp(lastline, "[LaCrosseITPlusReader", 21) == 0) {
-          /* this is output only received after reset or sending a "?".
-           * If we receive that and we haven't sent our init-string recently,
-           * it means the JeeLink has for some reason reset/rebooted, so we
-           * need to resend our init-string to make sure it receives the right
-           * frequencies/bitrates. */
-          if ((time(NULL) - lastsentinit) > 30) {
-            VERBPRINT(2, "%s\n", "JeeLink probably rebooted, re-sending init-string");
-            if (write(serialfd, jlinitstr, strlen(jlinitstr)) != strlen(jlinitstr)) {
-              fprintf(stderr, "%s\n", "WARNING: init-string was not sent to the Jeelink successfully.");
-            }
-            lastsentinit = time(NULL);
-          } else {
-            VERBPRINT(3, "Not resending init-string (%ld seconds passed since last time)\n", (long)(time(NULL) - lastsentinit));
-          }
-        } else {
-          parseserialline(lastline, dd);
-        }
-        llpos = 0;
-      }
-    } else {
-      lastline[llpos] = buf[i];
-      llpos++;
+  /* Rollups change when their period ends, new data or not. */
+  if (dd->cfmt.rollsecs != 0) {
+    time_t nextperiod = ((now / dd->cfmt.rollsecs) + 1) * dd->cfmt.rollsecs;
+    if ((dd->cacheexpires == 0) || (nextperiod < dd->cacheexpires)) {
+      dd->cacheexpires = nextperiod;
     }
   }
-  return ret;
 }
 
-static void dodaemon(int serialfd, struct daemondata * dd, char ** argv, char * jlinitstr) {
-  fd_set mylsocks;
-  struct daemondata * curdd;
-  struct timeval to;
-  int maxfd;
-  int readysocks;
-  time_t lastdatarecv;
-
-  lastdatarecv = time(NULL);
-  while (1) {
-    curdd = dd; /* Start from beginning */
-    maxfd = 0;
-    FD_ZERO(&mylsocks);
-    while (curdd != NULL) {
-      FD_SET(curdd->fd, &mylsocks);
-      if (curdd->fd > maxfd) { maxfd = curdd->fd; }
-      curdd = curdd->next;
-    }
-    FD_SET(serialfd, &mylsocks);
-    if (serialfd > maxfd) { maxfd = serialfd; }
-    to.tv_sec = 60; to.tv_usec = 1;
-    if ((readysocks = select((maxfd + 1), &mylsocks, NULL, NULL, &to)) < 0) { /* Error?! */
-      if (errno != EINTR) {
-        perror("ERROR: error on select()");
-        dotryrestart(dd, argv, serialfd);
-      }
-    } else {
-      if (FD_ISSET(serialfd, &mylsocks)) {
-        if (processserialdata(serialfd, dd, argv, jlinitstr) > 0) {
-          lastdatarecv = time(NULL);
-        }
-      }
-      curdd = dd;
-      while (curdd != NULL) {
-        if (FD_ISSET(curdd->fd, &mylsocks)) {
-          int tmpfd;
-          struct sockaddr_in6 srcad;
-          socklen_t adrlen = sizeof(srcad);
-          tmpfd = accept(curdd->fd, (struct sockaddr *)&srcad, &adrlen);
-          if (tmpfd < 0) {
-            perror("WARNING: Failed to accept() connection");
-          } else {
-            char outbuf[250];
-            printtooutbuf(outbuf, strlen(outbuf), curdd);
-            logaccess((struct sockaddr *)&srcad, adrlen, outbuf);
-            /* The write might fail if the client already disconnected, but
-             * there is nothing we can do anyways and the connection is closed
-             * immediately afterwards - so remove the gcc -Wunused-result warning.
-             * Note that the gcc devs like to force you to jump through hoops,
-             * thus simply casting the result to void is NOT enough to avoid the
-             * warning in gcc. */
-            int gccdevssuck __attribute__((unused));
-            gccdevssuck = write(tmpfd, outbuf, strlen(outbuf));
-            close(tmpfd);
-          }
-        }
-        curdd = curdd->next;
-      }
-    }
-    if (restartonerror) {
-      /* Did we receive something on the serial port recently? */
-      if ((time(NULL) - lastdatarecv) > 300) {
-        fprintf(stderr, "%s\n", "Timeout: No data from serial port for 5 minutes.");
-        dotryrestart(dd, argv, serialfd);
-      }
+/* Returns the output for dd, rendering it again only if it went stale. */
+static char * getcachedout(struct daemondata * dd, int * len) {
+  if (dd->cacheexpires != 0) {
+    time_t now = curtime();
+    if (now >= dd->cacheexpires) {
+      updatecachedout(dd, now);
     }
   }
-  /* never reached */
+  *len = dd->cachedlen;
+  return dd->cachedout;
 }
 
+/* When restarting after an error, the state of all sensors is handed to
+ * the new process in a memfd, whose number is passed in the environment.
+ * That way the values do not go N/A until every sensor has sent again.
+ * Both sides are the same binary, so this is just the raw structs, with a
+ * header to catch anything else. */
+#define STATESNAPENV "FOXTEMP_STATEFD"
+#define STATESNAPMAGIC 0x46545353 /* "FTSS" */
+struct statesnaphdr {
+  uint32_t magic;
+  uint32_t recsize;
+  uint32_t nrecs;
+};
+struct statesnaprec {
+  unsigned char sensortype;
+  unsigned char sensorid;
+  time_t lastseen;
+  struct sensorreading last;
+  uint16_t gaps[NUMGAPS];
+  unsigned int gappos;
+  unsigned int ngaps;
+};
 
-int main(int argc, char ** argv)
-{
-  int curarg;
-  int serialfd;
-  int forcebitrate = 0;
+/* Writes the state of all sensors served into a memfd, and puts it into
+ * the environment for the process we are about to exec. */
+static void savestate(void) {
+  struct statesnaphdr hdr;
+  struct statesnaprec rec;
+  struct sensorstate * ss;
+  char fdstr[20];
+  int ti, sid;
+  int fd;
 
-  for (curarg = 1; curarg < argc; curarg++) {
-    if        (strcmp(argv[curarg], "-v") == 0) {
-      verblev++;
-    } else if (strcmp(argv[curarg], "-q") == 0) {
-      verblev--;
-    } else if (strcmp(argv[curarg], "-f") == 0) {
-      runinforeground = 1;
-    } else if (strcmp(argv[curarg], "-C") == 0) {
-      receivertype = RECTCUL;
-    } else if (strcmp(argv[curarg], "-D") == 0) {
-      receivertype = RECTJEELDAVISV;
-    } else if (strcmp(argv[curarg], "-h") == 0) {
-      usage(argv[0]); exit(0);
-    } else if (strcmp(argv[curarg], "--help") == 0) {
-      usage(argv[0]); exit(0);
-    } else if (strcmp(argv[curarg], "--restartonerror") == 0) {
-      restartonerror += 5;
-    } else if (strcmp(argv[curarg], "-d") == 0) {
-      curarg++;
-      if (curarg >= argc) {
-        fprintf(stderr, "ERROR: -d requires a parameter!\n");
-        usage(argv[0]); exit(1);
-      }
-      serialport = strdup(argv[curarg]);
-    } else if (strcmp(argv[curarg], "-r") == 0) {
-      curarg++;
-      if (curarg >= argc) {
-        fprintf(stderr, "ERROR: -r requires a parameter!\n");
-        usage(argv[0]); exit(1);
-      }
-      forcebitrate = strtol(argv[curarg], NULL, 10);
-      if (forcebitrate == 1) { forcebitrate = 9579; }
-      if (forcebitrate == 2) { forcebitrate = 17241; }
-    } else {
-      /* Unknown - must be the command. */
-      break;
+  if ((fd = memfd_create("foxtempstate", 0)) < 0) {
+    VERBPRINT(0, "WARNING: can't save state for the restart: %s\n", strerror(errno));
+    return;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = STATESNAPMAGIC;
+  hdr.recsize = sizeof(struct statesnaprec);
+  for (ti = 0; ti < NUMSENSORTYPES; ti++) {
+    for (sid = 0; sid < 256; sid++) {
+      if ((ss = findsensor(knownsensortypes[ti], sid)) == NULL) continue;
+      if (ss->lastseen == 0) continue;
+      hdr.nrecs++;
     }
   }
-  if (curarg == argc) {
-    fprintf(stderr, "ERROR: No command given!\n");
-    usage(argv[0]);
-    exit(1);
+  if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) goto err;
+  for (ti = 0; ti < NUMSENSORTYPES; ti++) {
+    for (sid = 0; sid < 256; sid++) {
+      if ((ss = findsensor(knownsensortypes[ti], sid)) == NULL) continue;
+      if (ss->lastseen == 0) continue;
+      memset(&rec, 0, sizeof(rec));
+      rec.sensortype = ss->sensortype;
+      rec.sensorid = ss->sensorid;
+      rec.lastseen = ss->lastseen;
+      rec.last = ss->last;
+      memcpy(rec.gaps, ss->gaps, sizeof(rec.gaps));
+      rec.gappos = ss->gappos;
+      rec.ngaps = ss->ngaps;
+      if (write(fd, &rec, sizeof(rec)) != sizeof(rec)) goto err;
+    }
   }
-  serialfd = open(serialport, O_NOCTTY | O_NONBLOCK | O_RDWR);
-  if (serialfd < 0) {
-    fprintf(stderr, "ERROR: Could not open serial port %s (%s).\n", serialport, strerror(errno));
+  lseek(fd, 0, SEEK_SET);
+  sprintf(fdstr, "%d", fd);
+  setenv(STATESNAPENV, fdstr, 1);
+  VERBPRINT(1, "Saved the state of %u sensors for the restart\n", hdr.nrecs);
+  return;
+err:
+  VERBPRINT(0, "WARNING: can't save state for the restart: %s\n", strerror(errno));
+  close(fd);
+}
+
+static void dotryrestart(struct daemondata * dd, char ** argv) {
+  struct daemondata * curdd = dd;
+  struct receiver * rc;
+
+  if (!restartonerror) {
     exit(1);
   }
-  if (strcmp(argv[curarg], "daemon") == 0) { /* Daemon mode */
-    struct daemondata * mydaemondata = NULL;
-    int havefastsensors = 0;
-    char jlinitstr[500];
-    curarg++;
-    do {
-      int l; int optval;
-      struct daemondata * newdd;
-      struct sockaddr_in6 soa;
-      unsigned char sensorid[1000];
-
-      if (curarg >= argc) continue;
-      newdd = calloc(sizeof(struct daemondata), 1);
-      /* Initialize contents to 'invalid' markers where applicable */
-      newdd->lasthum = 106.0;
-      newdd->lasttemp = -274.0;
-      newdd->lastpressure = -1.0;
-      newdd->lastsolar = -1.0;
-      newdd->lastuv = -1.0;
-      newdd->lastrainrate = -1.0;
-      newdd->lastraintipcount = 0xffffffff;
-      newdd->next = mydaemondata;
-      mydaemondata = newdd;
-      l = sscanf(argv[curarg], "%999[^:]:%u:%999[^\n]",
-                 sensorid, &mydaemondata->port, &mydaemondata->outputformat[0]);
-      if (l < 2) {
-        fprintf(stderr, "ERROR: failed to parse daemon command parameter '%s'\n", argv[curarg]);
+  savestate();
+  /* close all open sockets */
+  for (rc = receivers; rc != NULL; rc = rc->next) {
+    close(rc->fd);
+  }
+  if (querylistenfd >= 0) {
+    close(querylistenfd);
+  }
+  if (metricslistenfd >= 0) {
+    close(metricslistenfd);
+  }
+  if (statslistenfd >= 0) {
+    close(statslistenfd);
+  }
+  if (mcastfd >= 0) {
+    close(mcastfd);
+  }
+  while (curdd != NULL) {
+    close(curdd->fd);
+    curdd = curdd->next;
+  }
+  fprintf(stderr, "Will try to restart in %d second(s)...\n", restartonerror);
+  sleep(restartonerror);
+  execv(argv[0], argv);
+  exit(1); /* This should never be reached, but just to be sure in case the exec fails... */
+}
+
+/* Calculate LaCrosse (compatible) CRC: CRC8 with polynomial 0x31, as in
+ * LaCrosseITPlusReader, but with the table from lcccrctab.h instead of bit
+ * by bit. */
+static uint8_t lcccrc(uint8_t * data, int len) {
+  int j;
+  uint8_t res = 0;
+  for (j = 0; j < len; j++) {
+    res = lcccrctab[res ^ data[j]];
+  }
+  return res;
+}
+
+/* Returns the next whitespace separated token from *p (and its length in
+ * *len), and advances *p to behind it. Returns NULL if there is none. */
+static unsigned char * nexttoken(unsigned char ** p, int * len) {
+  unsigned char * t = *p;
+  while ((*t == ' ') || (*t == '\t')) t++;
+  if (*t == 0) {
+    *p = t;
+    return NULL;
+  }
+  *p = t;
+  while ((**p != 0) && (**p != ' ') && (**p != '\t')) (*p)++;
+  *len = *p - t;
+  return t;
+}
+
+static int tokeneq(unsigned char * t, int len, char * s) {
+  return ((len == strlen(s)) && (strncmp((char *)t, s, len) == 0));
+}
+
+/* Parses a token that consists only of decimal digits. Returns 0 if the
+ * token is anything else. */
+static int tokentouint(unsigned char * t, int len, unsigned int * v) {
+  unsigned int res = 0;
+  int i;
+  for (i = 0; i < len; i++) {
+    if ((t[i] < '0') || (t[i] > '9')) return 0;
+    res = res * 10 + (t[i] - '0');
+  }
+  *v = res;
+  return 1;
+}
+
+/* Splits a line from a JeeLink, like "OK CC 8 247 98 194 159 169 198", in
+ * one pass and without copying it. The receiver-type ("CC" for custom
+ * sensors, "9" for LaCrosse) is returned in rtype, the numbers that follow
+ * in vals. The return value is the same number of conversions the
+ * sscanf("%s %s %u...") we used to do here would have returned. */
+#define JLMAXVALS 15
+static int tokenizejeelinkline(unsigned char * line, unsigned char ** rtype,
+                               int * rtlen, unsigned int * vals) {
+  unsigned char * t;
+  int len;
+  int ret = 0;
+  if ((t = nexttoken(&line, &len)) == NULL) return ret;
+  if (!tokeneq(t, len, "OK")) return ret;
+  ret++;
+  if ((*rtype = nexttoken(&line, rtlen)) == NULL) return ret;
+  ret++;
+  while ((ret < (JLMAXVALS + 2)) && ((t = nexttoken(&line, &len)) != NULL)) {
+    if (!tokentouint(t, len, &vals[ret - 2])) break;
+    ret++;
+  }
+  return ret;
+}
+
+
+/* The parse*line functions return 1 if the line contained a frame, and 0 if
+ * it was not a received packet at all. Packets that were received but are
+ * unusable return one of these instead, so they can be counted. */
+#define PARSE_BADCRC -1
+#define PARSE_BADLEN -2
+#define PARSE_CULFWTRUNC -3
+#define PARSE_UNKNOWNTYPE -4
+
+/* JeeLink: "OK CC <sid> <data...>" for custom sensors and
+ * "OK 9 <sid> <4 bytes>" for LaCrosse sensors. */
+/* OK CC 7 23 144 34 53 133                           hawotempdev2016 length=8 */
+/* OK CC 8 247 98 194 159 169 198                     foxtempdev2016  length=9 */
+/* OK 9 9 1 4 194 32                                  lacrosse        length=7 */
+/* OK CC 7 245 1 151 87 51 120 96 97 0 33 0 95 0      foxstaub2018    length=16 */
+/* OK CC 2 249 0 0 34 0 0 26 157                      foxgeig2018     length=11 */
+/* OK CC 7 253 99 175 152 104 230 119 60 62           hawotempdev2018 length=12 */
+static int parsejeelinkline(unsigned char * line, struct rxframe * f) {
+  unsigned char * rtype = NULL;
+  int rtlen = 0;
+  unsigned int vals[JLMAXVALS];
+  int ret; int i;
+
+  ret = tokenizejeelinkline(line, &rtype, &rtlen, vals);
+  if (ret < 2) return 0; /* Not a received packet */
+  if (tokeneq(rtype, rtlen, "CC")) {
+    if ((ret != 8) && (ret != 9) && (ret != 11) && (ret != 12) && (ret != 16)) {
+      return PARSE_BADLEN;
+    }
+    f->kind = FRAME_CUSTOM;
+  } else if (tokeneq(rtype, rtlen, "9")) {
+    if (ret != 7) return PARSE_BADLEN;
+    f->kind = FRAME_LACROSSE;
+  } else {
+    return PARSE_UNKNOWNTYPE;
+  }
+  for (i = 0; i < (ret - 2); i++) {
+    if (vals[i] > 255) return 0; /* These are bytes. Garbage otherwise. */
+  }
+  f->sensorid = vals[0];
+  f->len = ret - 3;
+  for (i = 0; i < f->len; i++) {
+    f->data[i] = vals[i + 1];
+  }
+  return 1;
+}
+
+static int hexnibble(unsigned char c) {
+  if ((c >= '0') && (c <= '9')) return c - '0';
+  if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+  if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+  return -1;
+}
+
+/* CUL (culfw native mode): the raw packet as hex, e.g.
+ * N02CC3A06F7604A9332EC0A04F6CCAB4D3058D5C5769932D398 (not with default culfw)
+ * N019CC4503651AAAA000381FFEB (default culfw, at most 12 bytes data)
+ * We do the same checks and conversions the JeeLink firmware would have
+ * done, and end up with the same frame. */
+static int parseculline(unsigned char * line, struct rxframe * f) {
+  uint8_t rawbytes[LLSIZE / 2];
+  int ppos; int i;
+
+  if ((strncmp((char *)line, "N01", 3) != 0)
+   && (strncmp((char *)line, "N02", 3) != 0)) {
+    return 0; /* Not a string containing a raw packet */
+  }
+  line += 3;
+  ppos = 0;
+  while ((line[0] != 0) && (line[1] != 0) && (ppos < sizeof(rawbytes))) {
+    int hn = hexnibble(line[0]);
+    int ln = hexnibble(line[1]);
+    if ((hn < 0) || (ln < 0)) return 0; /* non-hex stuff - invalid data */
+    rawbytes[ppos] = (hn << 4) | ln;
+    ppos++;
+    line += 2;
+  }
+  if (ppos < 6) return PARSE_BADLEN; /* This cannot be valid, it's too short */
+  if (rawbytes[0] == 0xcc) { /* "Custom" sensor */
+    /* Format: SSSSSSSS  IIIIIIII  BBBBBBBB  DDDDDDDD [...] DDDDDDDD  CCCCCCCC */
+    int datalen = rawbytes[2];
+    if ((datalen+3) >= ppos) { /* This is not long enough */
+      if (ppos == 12) {
+        /* By default, culfw only receives up to 12 bytes long packets.
+         * To fix this, you need to modify the file clib/rf_native.c in culfw
+         * and increase CC1100_FIFOTHR from the default 2 to at least 4 (=20
+         * bytes RX FIFO, that still leaves 45 bytes for the TX FIFO), then
+         * recompile the fw and reflash your CUL. */
+        VERBPRINT(3, "Discarding received custom sensor packet - claimed data"
+                     " length %d is too long for packet length %d. Note: this"
+                     " might be caused by a default culfw limitation.\n",
+                     datalen, ppos);
+        return PARSE_CULFWTRUNC;
+      }
+      VERBPRINT(3, "Discarding received custom sensor packet - claimed data"
+                   " length %d is too long for packet length %d\n",
+                   datalen, ppos);
+      return PARSE_BADLEN;
+    }
+    if (lcccrc(&rawbytes[0], datalen + 3) != rawbytes[datalen + 3]) { /* bad CRC */
+      VERBPRINT(3, "Discarding received custom sensor packet due to CRC fail\n");
+      return PARSE_BADCRC;
+    }
+    if (datalen > CUSTOMMAXLEN) return PARSE_BADLEN; /* None of our sensors sends that much */
+    f->kind = FRAME_CUSTOM;
+    f->sensorid = rawbytes[1];
+    f->len = datalen;
+    for (i = 0; i < datalen; i++) {
+      f->data[i] = rawbytes[i + 3];
+    }
+  } else if ((rawbytes[0] & 0xf0) == 0x90) { /* "LaCrosse" sensor */
+    /* Packets are always 5 bytes, and thanks to LaCrosseITPlusReader we
+     * know the format: SSSS.DDDD DDN_.TTTT TTTT.TTTT WHHH.HHHH CCCC.CCCC
+     * (see LaCrosseITPlusReader for detailed explanation) */
+    unsigned int rtemp;
+    /* Check CRC */
+    if (lcccrc(&rawbytes[0], 4) != rawbytes[4]) { /* bad CRC */
+      VERBPRINT(3, "Discarding received LaCrosse sensor data due to CRC fail\n");
+      return PARSE_BADCRC;
+    }
+    /* Temp is BCD (binary coded decimal) which is not nice to process :-/ */
+    /* On the other hand, it permits us to do some more sanity checks,
+     * hopefully catching more errors that the CRC did not */
+    if (((rawbytes[2] >> 4) >= 10) || ((rawbytes[2] & 0x0f) >= 10)) {
+      VERBPRINT(3, "Discarding received LaCrosse sensor data due to invalid BCD data\n");
+      return PARSE_BADCRC; /* just as corrupted as a CRC fail */
+    }
+    rtemp = (rawbytes[1] & 0x0f) * 100;
+    rtemp += (rawbytes[2] >> 4) * 10;
+    rtemp += (rawbytes[2] & 0x0f);
+    /* the format received from the sensor is (temp - 40.0), what the JeeLink
+     * reports is (temp + 100.0) instead. Why? I have no clue. */
+    rtemp += 600; /* 100 - 40 */
+    f->kind = FRAME_LACROSSE;
+    f->sensorid = ((rawbytes[0] & 0x0f) << 2) | (rawbytes[1] >> 6);
+    f->len = 4;
+    /* this would also encode a sensor type, but we don't decode that anyways */
+    f->data[0] = ((rawbytes[1] & 0x20) == 0x20) ? 129 : 1;
+    f->data[1] = (rtemp >> 8);
+    f->data[2] = (rtemp & 0xff);
+    f->data[3] = rawbytes[3];
+  } else { /* not a known sensor type */
+    return PARSE_UNKNOWNTYPE;
+  }
+  return 1;
+}
+
+static void putbe16(unsigned char * d, int v) {
+  d[0] = (v >> 8) & 0xff;
+  d[1] = (v >> 0) & 0xff;
+}
+
+static void putbe32(unsigned char * d, uint32_t v) {
+  d[0] = (v >> 24) & 0xff;
+  d[1] = (v >> 16) & 0xff;
+  d[2] = (v >> 8) & 0xff;
+  d[3] = (v >> 0) & 0xff;
+}
+
+static int32_t getbe32s(unsigned char * d) {
+  return (int32_t)(((uint32_t)d[0] << 24) | ((uint32_t)d[1] << 16)
+                 | ((uint32_t)d[2] << 8) | (uint32_t)d[3]);
+}
+
+/* Converts a value from the Davis firmware into thousandths, rounded. The
+ * firmware prints at most 2 decimals, so nothing it sends gets lost, only
+ * values beyond +-2147483 would be cut off. */
+#define DAVISSCALE 1000.0
+static int32_t davisfixed(unsigned char * vs) {
+  double d = strtod((char *)vs, NULL) * DAVISSCALE;
+  if (d < -2147483647.0) d = -2147483647.0;
+  if (d > 2147483647.0) d = 2147483647.0;
+  return (d < 0.0) ? (int32_t)(d - 0.5) : (int32_t)(d + 0.5);
+}
+
+/* JeeLink with DavisVantage receiver firmware.
+ * This differs in almost every aspect from our other receivers and sensors:
+ * We get a list of key=value pairs, and every packet only contains some of
+ * the values. We put what we get into a FRAME_DAVIS frame, all values as
+ * reported in thousandths (see davisfixed()), signed:
+ * Byte  0:    bitmask of the values present (DAVIS_HAS_*)
+ * Byte  1- 4: temperature
+ * Byte  5- 8: humidity
+ * Byte  9-12: UV as reported
+ * Byte 13-16: solar as reported
+ * Byte 17-20: seconds between rain bucket tips
+ * Byte    21: rain bucket tip counter
+ * Byte    22: battery ok (1) or low (0) */
+#define DAVISFRAMELEN 23
+#define DAVIS_HAS_TEMP 0x01
+#define DAVIS_HAS_HUM 0x02
+#define DAVIS_HAS_UV 0x04
+#define DAVIS_HAS_SOLAR 0x08
+#define DAVIS_HAS_RAINSECS 0x10
+#define DAVIS_HAS_RAINTIPS 0x20
+#define DAVIS_HAS_BATTERY 0x40
+static int parsedavisline(unsigned char * line, struct rxframe * f) {
+  unsigned char * pos = line;
+  unsigned char * t;
+  unsigned char * kvs;
+  unsigned int sid;
+  int len, kvslen;
+  // Example string:
+  // OK VALUES DAVIS 5 Channel=1,RSSI=-59,Battery=ok,WindSpeed=0.00,WindDirection=0,Humidity=87.00,
+  if (((t = nexttoken(&pos, &len)) == NULL) || (!tokeneq(t, len, "OK"))) return 0;
+  if (((t = nexttoken(&pos, &len)) == NULL) || (!tokeneq(t, len, "VALUES"))) return 0;
+  if (((t = nexttoken(&pos, &len)) == NULL) || (!tokeneq(t, len, "DAVIS"))) return 0;
+  if (((t = nexttoken(&pos, &len)) == NULL) || (!tokentouint(t, len, &sid))) return 0;
+  if ((kvs = nexttoken(&pos, &kvslen)) == NULL) return 0;
+  if (nexttoken(&pos, &len) != NULL) return 0;
+  if (sid > 255) return 0;
+  f->kind = FRAME_DAVIS;
+  f->sensorid = sid;
+  f->len = DAVISFRAMELEN;
+  memset(&f->data[0], 0, f->len);
+  VERBPRINT(4, "Received from Davis station %u:", sid);
+  /* now the actual real parsing starts: We need to split the long string
+   * into key=value pairs. Values end at the next ',', which is also where
+   * strtod() and friends stop, so there is no need to copy anything. */
+  while (kvslen > 0) {
+    unsigned char * ks = kvs; unsigned char * vs;
+    int kl, vl;
+    unsigned char * comma = memchr(kvs, ',', kvslen);
+    int partlen = (comma != NULL) ? (comma - kvs) : kvslen;
+    unsigned char * eq = memchr(kvs, '=', partlen);
+    kvs += partlen; kvslen -= partlen;
+    if (comma != NULL) { kvs++; kvslen--; }
+    if (eq == NULL) continue;
+    kl = eq - ks;
+    vs = eq + 1;
+    vl = partlen - kl - 1;
+    if ((kl == 0) || (vl == 0)) continue;
+    VERBPRINT(4, " [%.*s = %.*s]", kl, ks, vl, vs);
+    if        (tokeneq(ks, kl, "Temperature")) {
+      f->data[0] |= DAVIS_HAS_TEMP;
+      putbe32(&f->data[1], davisfixed(vs));
+    } else if (tokeneq(ks, kl, "Humidity")) {
+      f->data[0] |= DAVIS_HAS_HUM;
+      putbe32(&f->data[5], davisfixed(vs));
+    } else if (tokeneq(ks, kl, "UV")) {
+      f->data[0] |= DAVIS_HAS_UV;
+      putbe32(&f->data[9], davisfixed(vs));
+    } else if (tokeneq(ks, kl, "Solar")) {
+      f->data[0] |= DAVIS_HAS_SOLAR;
+      putbe32(&f->data[13], davisfixed(vs));
+    } else if (tokeneq(ks, kl, "WindSpeed")) {
+      /* not implemented */
+      /* our weather station does not have the wind vane so we cannot test. */
+    } else if (tokeneq(ks, kl, "WindDirection")) {
+      /* not implemented */
+      /* our weather station does not have the wind vane so we cannot test. */
+    } else if (tokeneq(ks, kl, "RainSecs")) {
+      f->data[0] |= DAVIS_HAS_RAINSECS;
+      putbe32(&f->data[17], davisfixed(vs));
+    } else if (tokeneq(ks, kl, "RainTipCount")) {
+      f->data[0] |= DAVIS_HAS_RAINTIPS;
+      f->data[21] = strtoul((char *)vs, NULL, 10);
+    } else if (tokeneq(ks, kl, "Battery")) {
+      f->data[0] |= DAVIS_HAS_BATTERY;
+      f->data[22] = tokeneq(vs, vl, "ok");
+    } else if (tokeneq(ks, kl, "Channel")) {
+      /* Useless for us */
+    } else if (tokeneq(ks, kl, "RSSI")) {
+      /* Useless for us */
+    } else {
+      VERBPRINT(4, " unknown:%.*s=%.*s,", kl, ks, vl, vs);
+    }
+  }
+  VERBPRINT(4, "\n");
+  return 1;
+}
+
+/* Turns a received frame into values. Returns the sensortype, or 0 if this
+ * is not a frame from a sensor we know. With verbose set, it also logs the
+ * values (if our verbosity level says so). */
+static unsigned char decodeframe(struct rxframe * f, struct sensorreading * r,
+                                 int verbose) {
+  unsigned char * parsed = &f->data[0];
+  unsigned int sid = f->sensorid;
+  unsigned char stype = 0;
+
+  initreading(r);
+  if ((f->kind == FRAME_CUSTOM) && (f->len == 5)) { /* hawotempdev2016 */
+    stype = 'H';
+    if ((parsed[0] == 0xff) && (parsed[1] == 0xff)) {
+      /* Sensor reported invalid data on the device. */
+    } else {
+      r->temp = ((165.0 / 16383.0) * (double)(((parsed[0] & 0x3f) << 8) | parsed[1])) - 40.0;
+    }
+    r->hum = (100.0 / 16383.0) * (double)((parsed[2] << 8) | parsed[3]);
+    r->voltage = 3.0 * (parsed[4] / 255.0);
+    if (verbose) VERBPRINT(1, "Received data from H-sensor %u: t=%.2lf h=%.2lf v=%.2lf\n",
+                 sid, r->temp, r->hum, r->voltage);
+  } else if ((f->kind == FRAME_CUSTOM) && (f->len == 6)) { /* foxtempdev2016 */
+    if (parsed[0] != 0xf7)  return 0; /* 'subtype' is not foxtemp (0xf7) */
+    stype = 'F';
+    r->temp = (-45.00 + 175.0 * ((double)((parsed[1] << 8) | parsed[2]) / 65535.0));
+    r->hum = (100.0 * ((double)((parsed[3] << 8) | parsed[4]) / 65535.0));
+    r->voltage = (3.3 * parsed[5]) / 255.0;
+    if (verbose) VERBPRINT(1, "Received data from F-sensor %u: t=%.2lf h=%.2lf v=%.2lf\n",
+                 sid, r->temp, r->hum, r->voltage);
+  } else if ((f->kind == FRAME_CUSTOM) && (f->len == 8)) { /* foxgeig2018 */
+    if (parsed[0] != 0xf9)  return 0; /* 'subtype' is not foxgeig (0xf9) */
+    stype = 'G';
+    r->cpm1 = ((uint32_t)parsed[1] << 16) | ((uint32_t)parsed[2] << 8)
+            | ((uint32_t)parsed[3]);
+    r->cpm60 = ((uint32_t)parsed[4] << 16) | ((uint32_t)parsed[5] << 8)
+             | ((uint32_t)parsed[6]);
+    r->voltage = 6.6 * (parsed[7] / 255.0);
+    if (verbose) VERBPRINT(1, "Received data from G-sensor %u: cpm1=%lu cpm60=%lu v=%.2lf\n",
+                 sid, (unsigned long)r->cpm1, (unsigned long)r->cpm60, r->voltage);
+  } else if ((f->kind == FRAME_CUSTOM) && (f->len == 9)) { /* hawotempdev2018 / foxtempdev with pressure sensor */
+    uint32_t newpraw;
+    if (parsed[0] != 0xfd)  return 0; /* 'subtype' is not hawotempdev2018 (0xfd) */
+    stype = 'D';
+    r->temp = (-45.00 + 175.0 * ((double)((parsed[1] << 8) | parsed[2]) / 65535.0));
+    r->hum = (100.0 * ((double)((parsed[3] << 8) | parsed[4]) / 65535.0));
+    r->voltage = (3.3 * parsed[5]) / 255.0;
+    newpraw = (((uint32_t)parsed[8] << 16) | ((uint32_t)parsed[7] <<  8)
+             | ((uint32_t)parsed[6] <<  0));
+    r->pressure = (double)newpraw / 4096.0;
+    if (verbose) VERBPRINT(1, "Received data from D-sensor %u: t=%.2lf h=%.2lf v=%.2lf p=%.3lf\n",
+                 sid, r->temp, r->hum, r->voltage, r->pressure);
+  } else if ((f->kind == FRAME_CUSTOM) && (f->len == 13)) { /* foxstaub2018, 2022 edition */
+    uint32_t newpraw;
+    if (parsed[0] != 0xf5)  return 0; /* 'subtype' is not foxstaub (0xf5) */
+    stype = 'S';
+    newpraw = (((uint32_t)parsed[1] << 16) | ((uint32_t)parsed[2] <<  8)
+             | ((uint32_t)parsed[3] <<  0));
+    if (newpraw != 0xffffff) {
+      r->pressure = (double)newpraw / 4096.0;
+    }
+    if ((parsed[4] != 0xff) || (parsed[5] != 0xff)) {
+      r->temp = (-45.00 + 175.0 * ((double)((parsed[4] << 8) | parsed[5]) / 65535.0));
+      r->hum = (100.0 * ((double)((parsed[6] << 8) | parsed[7]) / 65535.0));
+    }
+    r->pm2_5 = ((double)((parsed[8] << 8) | parsed[9])) / 10.0;
+    r->pm10 = ((double)((parsed[10] << 8) | parsed[11])) / 10.0;
+    /* Voltage is a bit complicated: reference voltage is set to 2.56V,
+     * so 255 == 2.56V at the ADC pin. The ADC pin however is connected
+     * through a 10M/1M voltage divider, so 1V at the ADC pin is actually
+     * 11V at the battery. */
+    r->voltage = ((double)parsed[12] / 100.0) * 11.0;
+    if (verbose) VERBPRINT(1, "Received data from S-sensor %u: t=%.2lf h=%.2lf p=%.3lf pm2_5=%.1lf pm10=%.1lf v=%.2lf\n",
+                 sid, r->temp, r->hum, r->pressure, r->pm2_5, r->pm10, r->voltage);
+  } else if ((f->kind == FRAME_LACROSSE) && (f->len == 4)) { /* cheap lacrosse */
+    stype = 'L';
+    r->temp = ((double)((parsed[1] << 8) | parsed[2]) - 1000.0) / 10.0;
+    r->hum = (double)(parsed[3] & 0x7f);
+    if ((parsed[3] & 0x80)) { /* There is no real voltage measurement available */
+      r->voltage = 1.0;       /* just a weak battery flag. We take a weak */
+    } else {                  /* battery as having 1.0 volt and everything else */
+      r->voltage = 2.5;       /* as having 2.5 volt. */
+    }
+    if (r->hum == 106.0) { /* has no humidity sensor */
+      if (verbose) VERBPRINT(1, "Received data from L-sensor %u: t=%.2lf NOHUMSENS%s%s\n",
+                   sid, r->temp,
+                   ((parsed[0] & 0x80) ? " NEWBATT" : ""),
+                   ((parsed[3] & 0x80) ? " WEAKBATT" : ""));
+    } else {
+      if (verbose) VERBPRINT(1, "Received data from L-sensor %u: t=%.2lf h=%.2lf%s%s\n",
+                   sid, r->temp, r->hum,
+                   ((parsed[0] & 0x80) ? " NEWBATT" : ""),
+                   ((parsed[3] & 0x80) ? " WEAKBATT" : ""));
+    }
+  } else if ((f->kind == FRAME_DAVIS) && (f->len == DAVISFRAMELEN)) {
+    stype = 'V';
+    if (verbose) VERBPRINT(1, "Received data from D-sensor %u:", sid);
+    if (parsed[0] & DAVIS_HAS_TEMP) {
+      r->temp = getbe32s(&parsed[1]) / DAVISSCALE;
+      if (verbose) VERBPRINT(1, " t=%.2lf,", r->temp);
+    }
+    if (parsed[0] & DAVIS_HAS_HUM) {
+      r->hum = getbe32s(&parsed[5]) / DAVISSCALE;
+      if (verbose) VERBPRINT(1, " h=%.2lf,", r->hum);
+    }
+    if (parsed[0] & DAVIS_HAS_UV) {
+      /* The firmware seems to do quite a bit of nonsense here.
+       * It will subtract 1 unconditionally, so seeing '-1' is
+       * perfectly normal, it can just mean there is no sun.
+       * You can get the "UV index" value from this by dividing
+       * through 50. */
+      r->uv = ((getbe32s(&parsed[9]) / DAVISSCALE) + 1.0) / 50.0;
+      if (verbose) VERBPRINT(1, " uv=%.2lf,", r->uv);
+    }
+    if (parsed[0] & DAVIS_HAS_SOLAR) {
+      r->solar = (getbe32s(&parsed[13]) / DAVISSCALE) + 1.0; // in W per m^2
+      if (verbose) VERBPRINT(1, " solint=%.2lf,", r->solar);
+    }
+    if (parsed[0] & DAVIS_HAS_RAINSECS) {
+      /* This is 'seconds between tips' of the bucket. The bucket seems
+       * to be differently sized in NorthAmerica (0.01 inch) and Europe
+       * (0.02mm). We just assume the european version here. */
+      double sbt = getbe32s(&parsed[17]) / DAVISSCALE;
+      if (sbt < 0.0) { /* the firmware _should_ report -1 on error */
+        r->rainrate = -1.0;
+      } else {
+        /* calculate mm per hour. 0.02mm is the tip size. */
+        r->rainrate = (3600 * 0.02) / sbt;
+      }
+      if (verbose) VERBPRINT(1, " rainrate=%.2lf,", r->rainrate);
+    }
+    if (parsed[0] & DAVIS_HAS_RAINTIPS) {
+      /* This is simply a 7 bit counter that counts up with every bucket
+       * tip, meaning it reverts back to 0 after 127. */
+      r->raintipcount = parsed[21];
+      if (verbose) VERBPRINT(1, " raintipctr=%lu,", (unsigned long)r->raintipcount);
+    }
+    if (parsed[0] & DAVIS_HAS_BATTERY) {
+      if (parsed[22]) {    /* These are the same fake voltage */
+        r->voltage = 2.5;  /* values we use for the lacrosse sensors, that */
+      } else {             /* also only have a ok / bad state and no real */
+        r->voltage = 1.0;  /* battery voltage measurement */
+      }
+      if (verbose) VERBPRINT(1, " v=%.2lf,", r->voltage);
+    }
+    if (verbose) VERBPRINT(1, "\n");
+  }
+  return stype;
+}
+
+/* Applies freshly received values r to the previous ones in last. */
+static void mergereading(unsigned char stype, struct sensorreading * last,
+                         struct sensorreading * r) {
+  if (stype != 'V') {
+    *last = *r;
+  } else {
+    /* We need special handling for the davis here, as it does not transmit
+     * all values at the same time. So for the davis, only update those values
+     * that were really transmitted. */
+    if (r->temp > -274.0) last->temp = r->temp;
+    if (r->hum != 106.0) last->hum = r->hum;
+    if (r->voltage > 0.0) last->voltage = r->voltage;
+    if (r->pressure > -1.0) last->pressure = r->pressure;
+    last->pm2_5 = r->pm2_5;
+    last->pm10 = r->pm10;
+    if (r->solar > -1.0) last->solar = r->solar;
+    if (r->uv > -1.0) last->uv = r->uv;
+    if (r->rainrate > -1.0) last->rainrate = r->rainrate;
+    last->cpm1 = r->cpm1;
+    last->cpm60 = r->cpm60;
+    if (r->raintipcount != 0xffffffff) last->raintipcount = r->raintipcount;
+  }
+}
+
+static void addhistory(struct sensorstate * ss, struct rxframe * f, time_t ts) {
+  struct histframe * hf;
+
+  if (histsize == 0) return;
+  ss->histts[ss->histhead] = ts;
+  hf = &ss->histframes[ss->histhead];
+  hf->kind = f->kind;
+  hf->len = f->len;
+  memcpy(hf->data, f->data, f->len);
+  ss->histhead = (ss->histhead + 1) % histsize;
+  if (ss->histcount < histsize) {
+    ss->histcount++;
+  }
+  ss->histadded++;
+}
+
+/* The day of the oldest segment in the log, -1 while there is none. This
+ * way a logdump from 0 does not try to open every day since 1970. */
+static long oldestlogday = -1;
+
+static void logsegmentname(char * buf, int len, long day) {
+  struct tm tm;
+  time_t t = (time_t)day * 86400;
+
+  gmtime_r(&t, &tm);
+  snprintf(buf, len, "%s/%04d%02d%02d.ftl", logdir,
+           tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+}
+
+/* Looks through logdir for the oldest segment, once at startup. */
+static void findoldestlogday(void) {
+  DIR * d;
+  struct dirent * de;
+  struct tm tm;
+  int y, m, md, n;
+  long day;
+
+  if ((d = opendir(logdir)) == NULL) return;
+  while ((de = readdir(d)) != NULL) {
+    n = 0;
+    if ((sscanf(de->d_name, "%4d%2d%2d.ftl%n", &y, &m, &md, &n) != 3)
+     || (n != 12) || (de->d_name[n] != 0)) continue;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = y - 1900;
+    tm.tm_mon = m - 1;
+    tm.tm_mday = md;
+    day = timegm(&tm) / 86400;
+    if ((oldestlogday < 0) || (day < oldestlogday)) {
+      oldestlogday = day;
+    }
+  }
+  closedir(d);
+}
+
+/* Appends a frame to the on-disk log, if we have one. */
+static void writelog(unsigned char stype, struct rxframe * f, time_t ts) {
+  static int logfd = -1;
+  static long logday = -1;
+  struct logrecord rec;
+  struct stat st;
+  char fn[1100];
+
+  if (logdir == NULL) return;
+  if ((ts / 86400) != logday) {
+    if (logfd >= 0) {
+      close(logfd);
+    }
+    logday = ts / 86400;
+    logsegmentname(fn, sizeof(fn), logday);
+    logfd = open(fn, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (logfd < 0) {
+      VERBPRINT(0, "WARNING: Could not open log %s (%s), not logging today.\n", fn, strerror(errno));
+      return;
+    }
+    if ((oldestlogday < 0) || (logday < oldestlogday)) {
+      oldestlogday = logday;
+    }
+    /* If we were killed in the middle of writing a record, throw away
+     * the incomplete rest so the following records stay aligned. */
+    if ((fstat(logfd, &st) == 0) && ((st.st_size % sizeof(rec)) != 0)) {
+      if (ftruncate(logfd, st.st_size - (st.st_size % sizeof(rec))) != 0) {
+        VERBPRINT(0, "WARNING: Could not repair log %s (%s).\n", fn, strerror(errno));
+      }
+    }
+  }
+  if (logfd < 0) return;
+  memset(&rec, 0, sizeof(rec));
+  rec.ts = ts;
+  rec.sensortype = stype;
+  rec.sensorid = f->sensorid;
+  rec.kind = f->kind;
+  rec.len = f->len;
+  memcpy(rec.data, f->data, f->len);
+  if (write(logfd, &rec, sizeof(rec)) != sizeof(rec)) {
+    VERBPRINT(0, "WARNING: Could not write to log: %s\n", strerror(errno));
+  }
+}
+
+/* The history and the log only contain raw frames. To render them, they
+ * are decoded into a copy of the sensorstate one after the other. */
+static void initreplaystate(struct sensorstate * tmpss, struct sensorstate * ss) {
+  *tmpss = *ss;
+  initreading(&tmpss->last);
+  tmpss->last.pm2_5 = 0.0;
+  tmpss->last.pm10 = 0.0;
+  tmpss->last.cpm1 = 0;
+  tmpss->last.cpm60 = 0;
+  tmpss->lastseen = 0;
+  memset(tmpss->rollups, 0, sizeof(tmpss->rollups)); /* not for the past */
+}
+
+/* Returns 0 if the frame could not be decoded. */
+static int replayframe(struct sensorstate * tmpss, uint8_t kind, uint8_t len,
+                       uint8_t * data, time_t ts) {
+  struct rxframe f;
+  struct sensorreading r;
+
+  f.kind = kind;
+  f.sensorid = tmpss->sensorid;
+  f.len = (len > RXFRAMEMAXLEN) ? RXFRAMEMAXLEN : len;
+  memcpy(f.data, data, f.len);
+  if (decodeframe(&f, &r, 0) != tmpss->sensortype) return 0;
+  mergereading(tmpss->sensortype, &tmpss->last, &r);
+  tmpss->lastseen = ts;
+  return 1;
+}
+
+/* Compiles the outputformat for a history or logdump request: fmtarg is
+ * what followed the arguments. Without an outputformat, that of the
+ * sensor is used, prefixed with "%L ". Returns 0 on success. */
+static int compilereplayfmt(struct compiledfmt * cf, struct sensorstate * ss,
+                            char * fmtarg) {
+  unsigned char deffmt[sizeof(((struct daemondata *)0)->outputformat) + 3];
+
+  if (*fmtarg == ' ') {
+    return compilefmt(cf, (unsigned char *)fmtarg + 1);
+  }
+  sprintf((char *)deffmt, "%%L %s", ss->subscribers->outputformat);
+  return compilefmt(cf, deffmt);
+}
+
+static int replaylinelen(struct compiledfmt * cf) {
+  return ((cf->maxlen < OUTBUFSIZE) ? cf->maxlen : (OUTBUFSIZE - 1)) + 1;
+}
+
+/* Appends the current state of tmpss to the output of qc, as one line.
+ * The caller needs to make sure there is space for replaylinelen(). */
+static void replayline(struct queryconn * qc, struct sensorstate * tmpss,
+                       struct compiledfmt * cf) {
+  qc->outqlen += renderfmt(qc->outq + qc->outqlen, replaylinelen(cf), cf,
+                           tmpss, tmpss->lastseen);
+  qc->outq[qc->outqlen++] = '\n';
+}
+
+/* How much of a history or logdump answer is rendered ahead of the client */
+#define REPLAYQSIZE 65536
+
+/* State of a history request. Like a logdump, it is only rendered as the
+ * client reads it. Entries are numbered by ss->histadded, so the ones that
+ * get overwritten in the ring while the client is slow can be noticed. */
+struct histcursor {
+  struct sensorstate * ss;
+  struct sensorstate tmpss;
+  struct compiledfmt fmt;
+  unsigned long first; /* the first entry that gets output */
+  unsigned long next;
+  unsigned long end; /* the newest entry when the request came in, plus one */
+};
+
+static void freehistcursor(struct queryconn * qc) {
+  struct histcursor * hc = qc->histcur;
+
+  if (hc == NULL) return;
+  freecompiledfmt(&hc->fmt);
+  free(hc);
+  qc->histcur = NULL;
+}
+
+/* Renders the next part of a history answer, as much as fits into the
+ * output queue. Frees the cursor once everything was rendered. */
+static void fillhistory(struct queryconn * qc) {
+  struct histcursor * hc = qc->histcur;
+  struct sensorstate * ss = hc->ss;
+  int linelen = replaylinelen(&hc->fmt);
+  unsigned int hp;
+
+  while ((qc->outqlen + linelen) <= qc->outqsize) {
+    if (hc->next >= hc->end) {
+      freehistcursor(qc);
+      return;
+    }
+    if (hc->next < (ss->histadded - ss->histcount)) {
+      /* Overwritten by newer entries in the meantime, these are lost. */
+      hc->next = ss->histadded - ss->histcount;
+      continue;
+    }
+    hp = hc->next % histsize;
+    hc->next++;
+    if (!replayframe(&hc->tmpss, ss->histframes[hp].kind, ss->histframes[hp].len,
+                     ss->histframes[hp].data, ss->histts[hp])) continue;
+    if (hc->next > hc->first) {
+      replayline(qc, &hc->tmpss, &hc->fmt);
+    }
+  }
+}
+
+/* State of a logdump request. The answer can get much bigger than we would
+ * want to keep in memory, so it is only rendered as the client reads it. */
+struct logcursor {
+  struct sensorstate tmpss;
+  struct compiledfmt fmt;
+  uint32_t from, to;
+  long day, lastday;
+  struct logrecord * recs; /* the mmap()ed segment of day */
+  size_t nrecs;
+  size_t pos;
+};
+
+static void freelogcursor(struct queryconn * qc) {
+  struct logcursor * lc = qc->logcur;
+
+  if (lc == NULL) return;
+  if (lc->recs != NULL) {
+    munmap(lc->recs, lc->nrecs * sizeof(struct logrecord));
+  }
+  freecompiledfmt(&lc->fmt);
+  free(lc);
+  qc->logcur = NULL;
+}
+
+/* Maps the segment for lc->day, and finds the first record at or after
+ * lc->from in it. Returns 0 if there is no (usable) segment for that day. */
+static int maplogsegment(struct logcursor * lc) {
+  char fn[1100];
+  struct stat st;
+  size_t lo, hi;
+  int fd;
+
+  logsegmentname(fn, sizeof(fn), lc->day);
+  fd = open(fn, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+  if ((fstat(fd, &st) != 0) || (st.st_size < sizeof(struct logrecord))) {
+    close(fd);
+    return 0;
+  }
+  lc->nrecs = st.st_size / sizeof(struct logrecord);
+  lc->recs = mmap(NULL, lc->nrecs * sizeof(struct logrecord), PROT_READ,
+                  MAP_SHARED, fd, 0);
+  close(fd);
+  if (lc->recs == MAP_FAILED) {
+    lc->recs = NULL;
+    return 0;
+  }
+  lo = 0; hi = lc->nrecs;
+  while (lo < hi) {
+    size_t mid = lo + ((hi - lo) / 2);
+    if (lc->recs[mid].ts < lc->from) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  lc->pos = lo;
+  return 1;
+}
+
+/* Renders the next part of a logdump answer, as much as fits into the
+ * output queue. Frees the cursor once everything was rendered. */
+static void filllogdump(struct queryconn * qc) {
+  struct logcursor * lc = qc->logcur;
+  int linelen = replaylinelen(&lc->fmt);
+  struct logrecord * lr;
+
+  while ((qc->outqlen + linelen) <= qc->outqsize) {
+    if (lc->recs == NULL) {
+      if (lc->day > lc->lastday) {
+        freelogcursor(qc);
+        return;
+      }
+      if (!maplogsegment(lc)) {
+        lc->day++;
+        continue;
+      }
+    }
+    if (lc->pos >= lc->nrecs) {
+      munmap(lc->recs, lc->nrecs * sizeof(struct logrecord));
+      lc->recs = NULL;
+      lc->day++;
+      continue;
+    }
+    lr = &lc->recs[lc->pos++];
+    if (lr->ts > lc->to) { /* nothing older can follow */
+      freelogcursor(qc);
+      return;
+    }
+    if ((lr->sensortype != lc->tmpss.sensortype)
+     || (lr->sensorid != lc->tmpss.sensorid)) continue;
+    if (replayframe(&lc->tmpss, lr->kind, lr->len, lr->data, lr->ts)) {
+      replayline(qc, &lc->tmpss, &lc->fmt);
+    }
+  }
+}
+
+/* Disconnects a query client. It is not freed here because there might
+ * still be events for it in the batch epoll_wait returned, that happens
+ * in freedeadqueryconns() afterwards. */
+static void killqueryconn(struct queryconn * qc) {
+  struct queryconn ** pqc;
+
+  if (qc->dead) return;
+  if (qc->ss != NULL) {
+    for (pqc = &qc->ss->pushconns; *pqc != NULL; pqc = &(*pqc)->nextpush) {
+      if (*pqc == qc) {
+        *pqc = qc->nextpush;
+        break;
+      }
+    }
+  }
+  if (qc->prevconn != NULL) {
+    qc->prevconn->nextconn = qc->nextconn;
+  } else {
+    allqueryconns = qc->nextconn;
+  }
+  if (qc->nextconn != NULL) {
+    qc->nextconn->prevconn = qc->prevconn;
+  }
+  close(qc->fd);
+  qc->dead = 1;
+  qc->nextpush = deadqueryconns;
+  deadqueryconns = qc;
+}
+
+static void freedeadqueryconns(void) {
+  struct queryconn * qc;
+
+  while (deadqueryconns != NULL) {
+    qc = deadqueryconns;
+    deadqueryconns = qc->nextpush;
+    if (qc->ss != NULL) {
+      freecompiledfmt(&qc->cfmt);
+    }
+    freelogcursor(qc);
+    freehistcursor(qc);
+    free(qc->outq);
+    free(qc);
+  }
+}
+
+/* Writes as much of the queued output of a client as the socket will
+ * take, and only asks epoll to tell us about writability while something
+ * is left over. */
+static void flushqueryconn(struct queryconn * qc) {
+  struct epoll_event ev;
+  int ret;
+  int wantout;
+
+  if (qc->logcur != NULL) {
+    filllogdump(qc);
+  }
+  if (qc->histcur != NULL) {
+    fillhistory(qc);
+  }
+  if (qc->outqlen > 0) {
+    ret = write(qc->fd, qc->outq, qc->outqlen);
+    if (ret < 0) {
+      if ((errno != EAGAIN) && (errno != EINTR)) {
+        killqueryconn(qc);
+        return;
+      }
+      ret = 0;
+    }
+    if (ret > 0) {
+      qc->lastactive = curtime();
+    }
+    qc->outqlen -= ret;
+    if ((ret > 0) && (qc->outqlen > 0)) {
+      memmove(qc->outq, qc->outq + ret, qc->outqlen);
+    }
+  }
+  if ((qc->outqlen == 0) && (qc->ss == NULL) && (qc->logcur == NULL)
+   && (qc->histcur == NULL)) {
+    /* That was a one-time answer, and it is complete now. */
+    killqueryconn(qc);
+    return;
+  }
+  wantout = (qc->outqlen > 0) || (qc->logcur != NULL) || (qc->histcur != NULL);
+  if (wantout != qc->wantout) {
+    memset(&ev, 0, sizeof(ev));
+    /* Once they closed their side, EPOLLIN would fire all the time */
+    ev.events = (qc->rdclosed ? 0 : EPOLLIN) | (wantout ? EPOLLOUT : 0);
+    ev.data.ptr = &qc->evh;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, qc->fd, &ev);
+    qc->wantout = wantout;
+  }
+}
+
+/* Sends a complete answer to a client, and closes the connection as soon
+ * as all of it is out. Whatever the socket does not take right away gets
+ * queued, so this never blocks. */
+static void sendanswer(struct queryconn * qc, const char * buf, int len) {
+  int ret;
+
+  ret = write(qc->fd, buf, len);
+  if (ret < 0) {
+    if ((errno != EAGAIN) && (errno != EINTR)) {
+      killqueryconn(qc);
+      return;
+    }
+    ret = 0;
+  }
+  if (ret >= len) {
+    killqueryconn(qc);
+    return;
+  }
+  free(qc->outq); /* if something went wrong halfway through a request */
+  qc->outqsize = len - ret;
+  qc->outq = malloc(qc->outqsize);
+  if (qc->outq == NULL) {
+    killqueryconn(qc);
+    return;
+  }
+  memcpy(qc->outq, buf + ret, qc->outqsize);
+  qc->outqlen = qc->outqsize;
+  flushqueryconn(qc);
+}
+
+/* Kills all connections that exceeded QCTIMEOUT. */
+static void sweepqueryconns(time_t now) {
+  struct queryconn * qc, * nextqc;
+
+  for (qc = allqueryconns; qc != NULL; qc = nextqc) {
+    nextqc = qc->nextconn;
+    if ((qc->ss != NULL) && (qc->outqlen == 0)) continue; /* idle subscriber */
+    if ((now - qc->lastactive) > QCTIMEOUT) {
+      logaccess((struct sockaddr *)&qc->srcad, qc->adrlen,
+                "disconnecting client after timeout");
+      killqueryconn(qc);
+    }
+  }
+}
+
+/* Sends the current state of its sensor to a subscriber, one line each. */
+static void pushtoqueryconn(struct queryconn * qc, time_t now) {
+  char outbuf[OUTBUFSIZE + 1];
+  int len;
+
+  len = renderfmt(outbuf, OUTBUFSIZE, &qc->cfmt, qc->ss, now);
+  if ((len == 0) || (outbuf[len - 1] != '\n')) {
+    outbuf[len++] = '\n';
+  }
+  if ((qc->outqlen + len) > qc->outqsize) {
+    logaccess((struct sockaddr *)&qc->srcad, qc->adrlen,
+              "disconnecting subscriber that does not keep up");
+    killqueryconn(qc);
+    return;
+  }
+  memcpy(qc->outq + qc->outqlen, outbuf, len);
+  qc->outqlen += len;
+  if (qc->outqlen == len) { /* nothing was queued before */
+    qc->lastactive = now;
+    flushqueryconn(qc);
+  }
+}
+
+/* Returns a bitmask of the ROLL_* values that are valid in r, and those
+ * values in v. */
+static int rollvalues(struct sensorreading * r, double * v) {
+  int valid = 0;
+#define ROLLVAL(f, cond, val) \
+  if (cond) { v[f] = (val); valid |= (1 << (f)); }
+  ROLLVAL(ROLL_T, r->temp > -274.0, r->temp);
+  ROLLVAL(ROLL_H, (r->hum >= 0.0) && (r->hum <= 100.0), r->hum);
+  ROLLVAL(ROLL_B, r->pressure >= 1.0, r->pressure);
+  ROLLVAL(ROLL_V, r->voltage > 0.0, r->voltage);
+  ROLLVAL(ROLL_PM2_5, r->pm2_5 >= 0.0, r->pm2_5);
+  ROLLVAL(ROLL_PM10, r->pm10 >= 0.0, r->pm10);
+  ROLLVAL(ROLL_CPM1, r->cpm1 != 0xffffff, r->cpm1);
+  ROLLVAL(ROLL_UV, r->uv > -1.0, r->uv);
+  ROLLVAL(ROLL_SOLAR, r->solar > -1.0, r->solar);
+  ROLLVAL(ROLL_RAINRATE, r->rainrate > -1.0, r->rainrate);
+#undef ROLLVAL
+  return valid;
+}
+
+/* Adds freshly received values to the current bucket of every period.
+ * That is a constant amount of work, no matter how much data we have. */
+static void addrollups(struct sensorstate * ss, struct sensorreading * r,
+                       time_t t) {
+  struct rollbucket * rb;
+  struct rollfield * rf;
+  double v[NUMROLLFIELDS];
+  uint32_t start;
+  int valid;
+  int i, j;
+
+  if (ss->rollups[0] == NULL) return;
+  valid = rollvalues(r, v);
+  for (i = 0; i < NUMROLLPERIODS; i++) {
+    start = t / rollperiods[i].seconds;
+    rb = &ss->rollups[i][start % rollperiods[i].nbuckets];
+    if (rb->start != start) { /* old data, start over */
+      memset(rb, 0, sizeof(struct rollbucket));
+      rb->start = start;
+    }
+    for (j = 0; j < NUMROLLFIELDS; j++) {
+      if ((valid & (1 << j)) == 0) continue;
+      rf = &rb->f[j];
+      if ((rf->count == 0) || (v[j] < rf->min)) rf->min = v[j];
+      if ((rf->count == 0) || (v[j] > rf->max)) rf->max = v[j];
+      rf->sum += v[j];
+      rf->count++;
+    }
+  }
+}
+
+/* With -m, the current state of every sensor we serve is also kept in a
+ * POSIX shared memory table, see foxtempshm.h. Its values[] are in the
+ * same order as the multicast datagrams. */
+_Static_assert((FOXTEMPSHM_RAINRATE == ROLL_RAINRATE)
+            && (FOXTEMPSHM_CPM60 == NUMROLLFIELDS + 0)
+            && (FOXTEMPSHM_RAINTIPS == NUMROLLFIELDS + 1),
+               "foxtempshm.h does not match the ROLL_* values");
+
+static struct foxtempshmslot * getshmslot(unsigned char stype, unsigned char sid) {
+  return &shmtable->slots[(stypeidx(stype) * 256) + sid];
+}
+
+static void openshm(char * name) {
+  struct sensorstate * ss;
+  int fd, ti, sid;
+  size_t size = FOXTEMPSHM_SIZE(NUMSENSORTYPES);
+
+  fd = shm_open(name, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: Could not open shared memory %s (%s).\n", name, strerror(errno));
+    exit(1);
+  }
+  if (ftruncate(fd, size) != 0) {
+    fprintf(stderr, "ERROR: Could not resize shared memory %s (%s).\n", name, strerror(errno));
+    exit(1);
+  }
+  shmtable = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shmtable == MAP_FAILED) {
+    fprintf(stderr, "ERROR: Could not map shared memory %s (%s).\n", name, strerror(errno));
+    exit(1);
+  }
+  /* Readers check the magic first, so write that last */
+  shmtable->magic = 0;
+  memset(shmtable->slots, 0, size - sizeof(struct foxtempshm));
+  shmtable->version = FOXTEMPSHM_VERSION;
+  shmtable->slotsize = sizeof(struct foxtempshmslot);
+  shmtable->ntypes = NUMSENSORTYPES;
+  memset(shmtable->types, 0, sizeof(shmtable->types));
+  memcpy(shmtable->types, knownsensortypes, NUMSENSORTYPES);
+  for (ti = 0; ti < NUMSENSORTYPES; ti++) {
+    for (sid = 0; sid < 256; sid++) {
+      if ((ss = sensorindex[ti][sid]) == NULL) continue;
+      getshmslot(ss->sensortype, sid)->sensortype = ss->sensortype;
+      getshmslot(ss->sensortype, sid)->sensorid = sid;
+    }
+  }
+  __atomic_store_n(&shmtable->magic, FOXTEMPSHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+/* Copies the state of ss into its slot, under the seqlock of the slot. */
+static void updateshm(struct sensorstate * ss) {
+  struct foxtempshmslot * slot = getshmslot(ss->sensortype, ss->sensorid);
+  double v[FOXTEMPSHM_NUMVALUES];
+  int valid;
+  uint32_t seq;
+
+  memset(v, 0, sizeof(v));
+  valid = rollvalues(&ss->last, v);
+  if (ss->last.cpm60 != 0xffffff) {
+    v[FOXTEMPSHM_CPM60] = ss->last.cpm60;
+    valid |= (1 << FOXTEMPSHM_CPM60);
+  }
+  if (ss->last.raintipcount != 0xffffffff) {
+    v[FOXTEMPSHM_RAINTIPS] = ss->last.raintipcount;
+    valid |= (1 << FOXTEMPSHM_RAINTIPS);
+  }
+  seq = slot->seq;
+  __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->sensortype = ss->sensortype;
+  slot->sensorid = ss->sensorid;
+  slot->valid = valid;
+  slot->lastseen = ss->lastseen;
+  slot->validuntil = validuntil(ss);
+  memcpy(slot->values, v, sizeof(slot->values));
+  __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Stores freshly received values for a sensor. */
+static void updatesensor(unsigned char stype, unsigned char sid,
+                         struct sensorreading * r) {
+  struct sensorstate * ss;
+  struct daemondata * curdd;
+  struct queryconn * qc, * nextqc;
+
+  ss = findsensor(stype, sid);
+  if (ss == NULL) return; /* Not a sensor we were asked to serve */
+  addgap(ss, curtime());
+  ss->lastseen = curtime();
+  mergereading(stype, &ss->last, r);
+  addrollups(ss, r, ss->lastseen);
+  metricsdirty = 1;
+  if (shmtable != NULL) {
+    updateshm(ss);
+  }
+  for (curdd = ss->subscribers; curdd != NULL; curdd = curdd->nextforsensor) {
+    updatecachedout(curdd, ss->lastseen);
+  }
+  for (qc = ss->pushconns; qc != NULL; qc = nextqc) {
+    nextqc = qc->nextpush; /* qc might get disconnected */
+    pushtoqueryconn(qc, ss->lastseen);
+  }
+}
+
+/* Takes over the state saved by savestate() before we were exec'ed, if
+ * there is any. Only sensors we serve are restored. */
+static void restorestate(void) {
+  struct statesnaphdr hdr;
+  struct statesnaprec rec;
+  struct sensorstate * ss;
+  struct daemondata * curdd;
+  char * fdstr;
+  unsigned int i, n = 0;
+  int fd;
+
+  if ((fdstr = getenv(STATESNAPENV)) == NULL) return;
+  fd = strtol(fdstr, NULL, 10);
+  unsetenv(STATESNAPENV); /* must not be passed on to the next restart */
+  if ((read(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+   || (hdr.magic != STATESNAPMAGIC) || (hdr.recsize != sizeof(rec))) {
+    VERBPRINT(0, "WARNING: ignoring saved state from before the restart.\n");
+    close(fd);
+    return;
+  }
+  for (i = 0; i < hdr.nrecs; i++) {
+    if (read(fd, &rec, sizeof(rec)) != sizeof(rec)) break;
+    if ((ss = findsensor(rec.sensortype, rec.sensorid)) == NULL) continue;
+    ss->lastseen = rec.lastseen;
+    ss->last = rec.last;
+    memcpy(ss->gaps, rec.gaps, sizeof(ss->gaps));
+    ss->gappos = rec.gappos % NUMGAPS;
+    ss->ngaps = (rec.ngaps > NUMGAPS) ? NUMGAPS : rec.ngaps;
+    learninterval(ss);
+    if (shmtable != NULL) {
+      updateshm(ss);
+    }
+    for (curdd = ss->subscribers; curdd != NULL; curdd = curdd->nextforsensor) {
+      updatecachedout(curdd, curtime());
+    }
+    n++;
+  }
+  close(fd);
+  metricsdirty = 1;
+  VERBPRINT(1, "Restored the state of %u sensors from before the restart\n", n);
+}
+
+static long long monotonicms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static int framesequal(struct rxframe * a, struct rxframe * b) {
+  return (a->kind == b->kind) && (a->sensorid == b->sensorid)
+      && (a->len == b->len) && (memcmp(a->data, b->data, a->len) == 0);
+}
+
+/* When several receivers are in range of a sensor, every one of its
+ * transmissions reaches us more than once, usually within a few
+ * milliseconds. Anything identical that arrives through a different receiver
+ * within this time is thrown away. It needs to stay well below the interval
+ * in which the sensors transmit, the fastest ones send every 4 seconds. */
+#define DEDUPWINDOWMS 2000
+
+/* With -M, every frame used is also sent as one UDP datagram to a multicast
+ * (or broadcast) address, so any number of consumers can get everything
+ * without connecting to us. All numbers are big-endian:
+ * Byte  0- 1: 'F' 'T'
+ * Byte     2: version of this format, currently 1
+ * Byte     3: sensortype (e.g. 'F')
+ * Byte     4: sensorid
+ * Byte     5: 0 (reserved)
+ * Byte  6- 7: bitmask of the values that follow: bits 0-9 are the values
+ *             in ROLL_* order (temperature, humidity, pressure, voltage,
+ *             PM2.5, PM10, CPM 1 min, UV, solar, rain rate), bit 10 is
+ *             CPM 60 min and bit 11 the rain tip counter
+ * Byte  8-11: unix timestamp when it was received
+ * Byte 12-  : for every bit set in the mask, in order, the value * 1000
+ *             as signed 32 bit integer
+ * For Davis stations, only what was in this particular frame is sent. */
+#define MCAST_VERSION 1
+#define MCAST_CPM60 (NUMROLLFIELDS + 0)
+#define MCAST_RAINTIPS (NUMROLLFIELDS + 1)
+#define MCAST_MAXLEN (12 + ((NUMROLLFIELDS + 2) * 4))
+static void publishframe(unsigned char stype, unsigned char sid,
+                         struct sensorreading * r, time_t t) {
+  unsigned char dg[MCAST_MAXLEN];
+  double v[NUMROLLFIELDS + 2];
+  int valid;
+  int len = 12;
+  int i;
+
+  valid = rollvalues(r, v);
+  if (r->cpm60 != 0xffffff) {
+    v[MCAST_CPM60] = r->cpm60;
+    valid |= (1 << MCAST_CPM60);
+  }
+  if (r->raintipcount != 0xffffffff) {
+    v[MCAST_RAINTIPS] = r->raintipcount;
+    valid |= (1 << MCAST_RAINTIPS);
+  }
+  dg[0] = 'F';
+  dg[1] = 'T';
+  dg[2] = MCAST_VERSION;
+  dg[3] = stype;
+  dg[4] = sid;
+  dg[5] = 0;
+  putbe16(&dg[6], valid);
+  putbe32(&dg[8], t);
+  for (i = 0; i < (NUMROLLFIELDS + 2); i++) {
+    double d;
+    if ((valid & (1 << i)) == 0) continue;
+    d = v[i] * 1000.0;
+    if (d > 2147483647.0) d = 2147483647.0;
+    if (d < -2147483648.0) d = -2147483648.0;
+    putbe32(&dg[len], (int32_t)((d < 0.0) ? (d - 0.5) : (d + 0.5)));
+    len += 4;
+  }
+  /* Nobody might be listening, and we never wait for the network. */
+  if (send(mcastfd, dg, len, MSG_DONTWAIT) < 0) {
+    VERBPRINT(3, "Sending multicast datagram failed: %s\n", strerror(errno));
+  }
+}
+
+/* Opens the socket for -M, dest is "address:port" with IPv6 addresses in
+ * brackets, e.g. "239.23.42.1:7777" or "[ff15::f0:7e]:7777". */
+static int openmcast(char * dest) {
+  struct addrinfo hints, * res;
+  char host[100];
+  char * port;
+  char * h = dest;
+  int fd, hl, optval, ret;
+
+  port = strrchr(dest, ':');
+  if (port == NULL) return -1;
+  if ((dest[0] == '[') && (port > dest) && (port[-1] == ']')) {
+    h = dest + 1;
+    hl = port - dest - 2;
+  } else {
+    hl = port - dest;
+  }
+  if ((hl <= 0) || (hl >= sizeof(host))) return -1;
+  memcpy(host, h, hl);
+  host[hl] = 0;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+  if ((ret = getaddrinfo(host, port + 1, &hints, &res)) != 0) {
+    fprintf(stderr, "ERROR: invalid multicast destination %s (%s).\n", dest, gai_strerror(ret));
+    exit(1);
+  }
+  fd = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("ERROR: Could not create UDP socket");
+    exit(1);
+  }
+  optval = 1; /* so it can also be a broadcast address */
+  if (setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &optval, sizeof(optval))) {
+    VERBPRINT(0, "WARNING: failed to setsockopt SO_BROADCAST: %s", strerror(errno));
+  }
+  if (connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+    fprintf(stderr, "ERROR: Could not use multicast destination %s (%s).\n", dest, strerror(errno));
+    exit(1);
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+/* Uses a decoded frame that was received through rc. */
+static void usereading(struct receiver * rc, struct rxframe * f,
+                       unsigned char stype, struct sensorreading * r) {
+  struct sensorstate * ss;
+  long long now;
+
+  ss = findsensor(stype, f->sensorid);
+  if ((ss == NULL) && trackallsensors) {
+    ss = getsensorstate(stype, f->sensorid);
+  }
+  if (ss == NULL) return; /* Not a sensor we were asked to serve */
+  now = monotonicms();
+  if ((ss->lastframefrom != NULL) && (ss->lastframefrom != rc)
+   && ((now - ss->lastframems) < DEDUPWINDOWMS)
+   && framesequal(&ss->lastframe, f)) {
+    VERBPRINT(2, "Ignoring frame from %c-sensor %u on %s, already received on %s\n",
+                 stype, f->sensorid, rc->devname, ss->lastframefrom->devname);
+    rc->ndupes++;
+    return;
+  }
+  ss->nframes++;
+  ss->lastframe = *f;
+  ss->lastframefrom = rc;
+  ss->lastframems = now;
+  addhistory(ss, f, curtime());
+  writelog(stype, f, curtime());
+  updatesensor(stype, f->sensorid, r);
+  if (mcastfd >= 0) {
+    publishframe(stype, f->sensorid, r, curtime());
+  }
+}
+
+/* What the reading thread of a receiver hands over to the main thread. */
+#define RINGSIZE 256 /* must be a power of 2 */
+struct ringitem {
+  struct rxframe f;
+  struct sensorreading r;
+  unsigned char stype;
+};
+
+static void handleframe(struct receiver * rc, struct rxframe * f) {
+  struct ringitem * ri;
+  struct sensorreading r;
+  unsigned char stype;
+  unsigned int head;
+  uint64_t one = 1;
+
+  stype = decodeframe(f, &r, 1);
+  if (stype == 0) { /* Not a known/supported sensor */
+    RCCOUNT(rc, nunknowntype);
+    return;
+  }
+  RCCOUNT(rc, nframes);
+  if (rc->ring == NULL) { /* No thread, so we are the main thread */
+    usereading(rc, f, stype, &r);
+    return;
+  }
+  head = rc->ringhead;
+  if ((head - __atomic_load_n(&rc->ringtail, __ATOMIC_ACQUIRE)) >= RINGSIZE) {
+    /* The main thread lags behind. Rather than throwing frames away, wait
+     * for it - until then, the kernel buffers what the receiver sends. */
+    RCCOUNT(rc, nringfull);
+    do {
+      usleep(1000);
+    } while ((head - __atomic_load_n(&rc->ringtail, __ATOMIC_ACQUIRE)) >= RINGSIZE);
+  }
+  ri = &rc->ring[head & (RINGSIZE - 1)];
+  ri->f = *f;
+  ri->r = r;
+  ri->stype = stype;
+  __atomic_store_n(&rc->ringhead, head + 1, __ATOMIC_RELEASE);
+  if (write(rc->evfd, &one, sizeof(one)) != sizeof(one)) {
+    /* Can only fail if the counter overflows, and then it is awake anyways */
+  }
+}
+
+static void parseserialline(struct receiver * rc, unsigned char * line) {
+  struct rxframe f;
+  int ret;
+
+  if (rc->type == RECTJEELDAVISV) {
+    ret = parsedavisline(line, &f);
+  } else if (rc->type == RECTCUL) {
+    ret = parseculline(line, &f);
+  } else {
+    ret = parsejeelinkline(line, &f);
+  }
+  if (ret > 0) {
+    handleframe(rc, &f);
+  } else if (ret == PARSE_BADCRC) {
+    RCCOUNT(rc, ncrcfail);
+  } else if (ret == PARSE_CULFWTRUNC) {
+    RCCOUNT(rc, nculfwtrunc);
+  } else if (ret == PARSE_BADLEN) {
+    RCCOUNT(rc, nbadlen);
+  } else if (ret == PARSE_UNKNOWNTYPE) {
+    RCCOUNT(rc, nunknowntype);
+  }
+}
+
+/* Handles one complete line received from rc, without its line end. */
+static void processserialline(struct receiver * rc, unsigned char * line) {
+  RCCOUNT(rc, nlines);
+  VERBPRINT(2, "Received on %s: %s\n", rc->devname, line);
+  if (strncmp(line, "[LaCrosseITPlusReader", 21) == 0) {
+    /* this is output only received after reset or sending a "?".
+     * If we receive that and we haven't sent our init-string recently,
+     * it means the JeeLink has for some reason reset/rebooted, so we
+     * need to resend our init-string to make sure it receives the right
+     * frequencies/bitrates. */
+    if (rc->ring != NULL) pthread_mutex_lock(&rc->initlock);
+    if ((curtime() - rc->lastsentinit) > 30) {
+      VERBPRINT(2, "JeeLink on %s probably rebooted, re-sending init-string\n", rc->devname);
+      RCCOUNT(rc, nreboots);
+      if ((rc->fd >= 0)
+       && (write(rc->fd, rc->initstr, strlen(rc->initstr)) != strlen(rc->initstr))) {
+        fprintf(stderr, "WARNING: init-string was not sent to the Jeelink on %s successfully.\n", rc->devname);
+      }
+      rc->lastsentinit = curtime();
+    } else {
+      VERBPRINT(3, "Not resending init-string (%ld seconds passed since last time)\n", (long)(curtime() - rc->lastsentinit));
+    }
+    if (rc->ring != NULL) pthread_mutex_unlock(&rc->initlock);
+  } else {
+    parseserialline(rc, line);
+  }
+}
+
+/* Splits what we received from a receiver into lines and handles them.
+ * This works on the input buffer of rc in place, and moves what is left
+ * of an incomplete line to the start of the buffer. Lines are terminated
+ * by \r, \n or \0. A line of LLSIZE characters or more is counted and
+ * thrown away as a whole, parsing only a part of it could not give
+ * anything sensible. */
+static void framelines(struct receiver * rc) {
+  unsigned char * p = rc->inbuf;
+  unsigned char * end = rc->inbuf + rc->inlen;
+  unsigned char * eol;
+
+  while (p < end) {
+    for (eol = p; eol < end; eol++) {
+      if ((*eol == '\n') || (*eol == '\r') || (*eol == 0)) break;
+    }
+    if (eol >= end) break; /* not complete yet */
+    *eol = 0;
+    if (rc->discarding) { /* the end of an overlong line */
+      rc->discarding = 0;
+    } else if ((eol - p) >= LLSIZE) {
+      RCCOUNT(rc, noverlong);
+      VERBPRINT(2, "Ignoring overlong line (%d characters) on %s\n", (int)(eol - p), rc->devname);
+    } else if (eol > p) {
+      processserialline(rc, p);
+    }
+    p = eol + 1;
+  }
+  rc->inlen = end - p;
+  if ((rc->inlen >= LLSIZE) && !rc->discarding) {
+    RCCOUNT(rc, noverlong);
+    VERBPRINT(2, "Ignoring overlong line (more than %d characters) on %s\n", LLSIZE - 1, rc->devname);
+    rc->discarding = 1;
+  }
+  if (rc->discarding) {
+    rc->inlen = 0;
+  } else if ((rc->inlen > 0) && (p != rc->inbuf)) {
+    memmove(rc->inbuf, p, rc->inlen);
+  }
+}
+
+/* For everything not reading the serial port itself (replay). */
+static void processserialbytes(struct receiver * rc, unsigned char * buf, int len) {
+  int n;
+
+  while (len > 0) {
+    n = INBUFSIZE - rc->inlen;
+    if (n > len) n = len;
+    memcpy(rc->inbuf + rc->inlen, buf, n);
+    rc->inlen += n;
+    framelines(rc);
+    buf += n;
+    len -= n;
+  }
+}
+
+/* The thread reading from the serial port of a receiver. */
+static void * serialthread(void * arg) {
+  struct receiver * rc = arg;
+  uint64_t one = 1;
+  int ret;
+
+  while (1) {
+    /* framelines() always leaves at least INBUFSIZE - LLSIZE free */
+    ret = read(rc->fd, rc->inbuf + rc->inlen, INBUFSIZE - rc->inlen);
+    if (ret <= 0) {
+      if ((ret < 0) && (errno == EINTR)) continue;
+      /* Let the main thread deal with it, it is the only one that can */
+      __atomic_store_n(&rc->readerr, (ret < 0) ? errno : EIO, __ATOMIC_RELEASE);
+      if (write(rc->evfd, &one, sizeof(one)) != sizeof(one)) {
         exit(1);
       }
-      if (l == 2) {
-        strcpy((char *)&mydaemondata->outputformat[0], "%S %T");
-      }
-      if ((sensorid[0] >= (unsigned char)'0') && (sensorid[0] <= (unsigned char)'9')) {
-        /* JUST a number. This is easy. */
-        mydaemondata->sensortype = (unsigned char)'H';
-        mydaemondata->sensorid = strtoul(sensorid, NULL, 0);
-      } else { /* type+ID - this needs to be a known type */
-        switch (sensorid[0]) {
-        case 'F':
-        case 'f':
-        case 'G':
-        case 'g':
-        case 'L':
-        case 'l':
-        case 'S':
-        case 's': /* these often use the faster data rate */
-                  havefastsensors = 1;
-                  /* no break here, fall through! */
-        case 'D':
-        case 'd':
-        case 'H':
-        case 'h':
-        case 'V':
-        case 'v':
-                  mydaemondata->sensortype = toupper(sensorid[0]);
-                  break;
-        default:
-                  fprintf(stderr, "ERROR: Unknown sensortype selected in daemon parameter '%s'.\n", argv[curarg]);
-                  exit(1);
-        };
-        mydaemondata->sensorid = strtoul(&sensorid[1], NULL, 0);
+      return NULL;
+    }
+    __atomic_store_n(&rc->lastdatarecv, time(NULL), __ATOMIC_RELAXED);
+    rc->inlen += ret;
+    framelines(rc);
+  }
+}
+
+/* Called in the main thread when the reading thread of rc woke us up. */
+static void processserialdata(struct receiver * rc, struct daemondata * dd, char ** argv) {
+  struct ringitem * ri;
+  unsigned int tail;
+  uint64_t cnt;
+
+  if (read(rc->evfd, &cnt, sizeof(cnt)) != sizeof(cnt)) {
+    /* Spurious wakeup, check anyways */
+  }
+  tail = rc->ringtail;
+  while (tail != __atomic_load_n(&rc->ringhead, __ATOMIC_ACQUIRE)) {
+    ri = &rc->ring[tail & (RINGSIZE - 1)];
+    usereading(rc, &ri->f, ri->stype, &ri->r);
+    tail++;
+    __atomic_store_n(&rc->ringtail, tail, __ATOMIC_RELEASE);
+  }
+  if (__atomic_load_n(&rc->readerr, __ATOMIC_ACQUIRE) != 0) {
+    fprintf(stderr, "unexpected ERROR reading serial input from %s: %s\n", rc->devname, strerror(rc->readerr));
+    dotryrestart(dd, argv);
+  }
+}
+
+/* Gives rc a thread of its own that does all the reading and parsing. */
+static void startserialthread(struct receiver * rc) {
+  sigset_t allsigs, oldsigs;
+  int ret;
+
+  rc->ring = calloc(RINGSIZE, sizeof(struct ringitem));
+  rc->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if ((rc->ring == NULL) || (rc->evfd < 0)
+   || (pthread_mutex_init(&rc->initlock, NULL) != 0)) {
+    fprintf(stderr, "ERROR: Could not set up the thread for %s.\n", rc->devname);
+    exit(1);
+  }
+  /* The thread may block as long as it likes */
+  fcntl(rc->fd, F_SETFL, fcntl(rc->fd, F_GETFL) & ~O_NONBLOCK);
+  /* Signals (SIGHUP for reloading) are for the main thread only, the
+   * thread inherits our signal mask. */
+  sigfillset(&allsigs);
+  pthread_sigmask(SIG_SETMASK, &allsigs, &oldsigs);
+  ret = pthread_create(&rc->thread, NULL, serialthread, rc);
+  pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+  if (ret != 0) {
+    fprintf(stderr, "ERROR: Could not start the thread for %s (%s).\n", rc->devname, strerror(ret));
+    exit(1);
+  }
+}
+
+static void epolladd(int epfd, int fd, struct evhandle * evh) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = evh;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    fprintf(stderr, "ERROR: failed to add fd %d to epoll set: %s\n", fd, strerror(errno));
+    exit(1);
+  }
+}
+
+/* Sends the counters of all receivers and sensors, one line each, e.g.
+ * "receiver /dev/ttyUSB0 jeelink lines=123 frames=120 ..." and
+ * "sensor F23 frames=120 queries=7 lastseen=1700000000 interval=24 ...".
+ * The packet loss of a sensor is missed / (missed + frames). */
+#define STATSLINELEN 300
+static void answerstats(struct queryconn * qc) {
+  struct receiver * rc;
+  struct sensorstate * ss;
+  int n = 0;
+  int ti, sid;
+  char * o;
+  int space;
+
+  for (rc = receivers; rc != NULL; rc = rc->next) n++;
+  for (ti = 0; ti < NUMSENSORTYPES; ti++) {
+    for (sid = 0; sid < 256; sid++) {
+      if (findsensor(knownsensortypes[ti], sid) != NULL) n++;
+    }
+  }
+  qc->outqsize = (n * STATSLINELEN) + 1;
+  qc->outq = malloc(qc->outqsize);
+  if (qc->outq == NULL) {
+    killqueryconn(qc);
+    return;
+  }
+  o = (char *)qc->outq;
+  space = qc->outqsize - 1;
+  for (rc = receivers; rc != NULL; rc = rc->next) {
+    qc->outqlen += bprintf(o + qc->outqlen, space - qc->outqlen,
+                           "receiver %s %s lines=%lu frames=%lu dupes=%lu"
+                           " crcfail=%lu badlen=%lu culfwtrunc=%lu"
+                           " unknowntype=%lu reboots=%lu ringfull=%lu"
+                           " overlong=%lu\n",
+                           rc->devname,
+                           (rc->type < 0) ? "unknown" : rectnames[rc->type],
+                           RCREAD(rc, nlines), RCREAD(rc, nframes), rc->ndupes,
+                           RCREAD(rc, ncrcfail), RCREAD(rc, nbadlen),
+                           RCREAD(rc, nculfwtrunc), RCREAD(rc, nunknowntype),
+                           RCREAD(rc, nreboots), RCREAD(rc, nringfull),
+                           RCREAD(rc, noverlong));
+  }
+  for (ti = 0; ti < NUMSENSORTYPES; ti++) {
+    for (sid = 0; sid < 256; sid++) {
+      if ((ss = findsensor(knownsensortypes[ti], sid)) == NULL) continue;
+      qc->outqlen += bprintf(o + qc->outqlen, space - qc->outqlen,
+                             "sensor %c%d frames=%lu queries=%lu lastseen=%ld"
+                             " interval=%ld missed=%lu validuntil=%ld\n",
+                             ss->sensortype, sid, ss->nframes, ss->nqueries,
+                             (long)ss->lastseen, (long)ss->interval,
+                             ss->nmissed, (long)validuntil(ss));
+    }
+  }
+  logaccess((struct sockaddr *)&qc->srcad, qc->adrlen, "stats");
+  flushqueryconn(qc);
+}
+
+/* Accepts a connection on any of our ports. Every client is handled
+ * through a queryconn, so that no client can ever block us. */
+static struct queryconn * acceptqueryconn(int listenfd) {
+  struct queryconn * qc;
+  int tmpfd;
+  struct sockaddr_in6 srcad;
+  socklen_t adrlen = sizeof(srcad);
+
+  tmpfd = accept(listenfd, (struct sockaddr *)&srcad, &adrlen);
+  if (tmpfd < 0) {
+    perror("WARNING: Failed to accept() connection");
+    return NULL;
+  }
+  if (fcntl(tmpfd, F_SETFL, fcntl(tmpfd, F_GETFL) | O_NONBLOCK) < 0) {
+    perror("WARNING: Failed to make query connection nonblocking");
+    close(tmpfd);
+    return NULL;
+  }
+  /* Subscribers can stay connected for a long time, so make sure they do
+   * not leak into whatever we exec() on a restart. */
+  fcntl(tmpfd, F_SETFD, FD_CLOEXEC);
+  qc = calloc(sizeof(struct queryconn), 1);
+  if (qc == NULL) {
+    close(tmpfd);
+    return NULL;
+  }
+  qc->fd = tmpfd;
+  qc->srcad = srcad;
+  qc->adrlen = adrlen;
+  qc->ishttp = (listenfd == metricslistenfd);
+  qc->lastactive = curtime();
+  qc->nextconn = allqueryconns;
+  if (allqueryconns != NULL) {
+    allqueryconns->prevconn = qc;
+  }
+  allqueryconns = qc;
+  qc->evh.evtype = EVT_QUERYCONN;
+  qc->evh.obj = qc;
+  epolladd(epfd, qc->fd, &qc->evh);
+  if (listenfd == statslistenfd) {
+    answerstats(qc); /* no request needed, just send it */
+  }
+  return qc;
+}
+
+/* Parses "[sensortype]sensorid" with an optional outputformat separated by
+ * a space. Returns the sensor, or NULL with *err set to what the client
+ * should be told. *fmt is set to the outputformat or NULL if none given. */
+static struct sensorstate * parsequery(unsigned char * q, unsigned char ** fmt,
+                                       char ** err) {
+  unsigned char stype, sid;
+  unsigned char * rest;
+  struct sensorstate * ss;
+
+  if ((parsesensorkey(q, &stype, &sid, &rest) != 0)
+   || ((*rest != 0) && (*rest != ' '))) {
+    *err = "ERROR: invalid query\n";
+    return NULL;
+  }
+  if ((ss = findsensor(stype, sid)) == NULL) {
+    *err = "ERROR: unknown sensor\n";
+    return NULL;
+  }
+  if ((*rest == ' ') && (strlen((char *)rest + 1) > MAXFMTLEN)) {
+    *err = ERRFMTTOOLONG;
+    return NULL;
+  }
+  ss->nqueries++;
+  *fmt = (*rest == ' ') ? (rest + 1) : NULL;
+  return ss;
+}
+
+/* Handles one request line on the query port. The answer is exactly what
+ * a dedicated port for that sensor (and format) would have sent. */
+static void answerquery(struct queryconn * qc) {
+  unsigned char * fmt;
+  struct sensorstate * ss;
+  struct compiledfmt tmpfmt;
+  char outbuf[OUTBUFSIZE];
+  char * out = outbuf;
+  int outlen = -1;
+
+  if ((ss = parsequery(qc->inbuf, &fmt, &out)) != NULL) {
+    if (fmt != NULL) { /* custom outputformat */
+      if (compilefmt(&tmpfmt, fmt) != 0) {
+        out = "ERROR: out of memory\n";
+      } else {
+        renderfmt(outbuf, sizeof(outbuf), &tmpfmt, ss, time(NULL));
+        freecompiledfmt(&tmpfmt);
+      }
+    } else {
+      /* If a sensor is configured more than once, this is the outputformat
+       * of the last one given. */
+      out = getcachedout(ss->subscribers, &outlen);
+    }
+  }
+  if (outlen < 0) {
+    outlen = strlen(out);
+  }
+  logaccess((struct sockaddr *)&qc->srcad, qc->adrlen, out);
+  sendanswer(qc, out, outlen);
+}
+
+/* Handles "subscribe <query>": the connection stays open, and gets the
+ * current output and then a new line whenever the sensor sends something. */
+static void subscribequery(struct queryconn * qc) {
+  unsigned char * fmt;
+  struct sensorstate * ss;
+  char * err;
+
+  if ((ss = parsequery(qc->inbuf + 10, &fmt, &err)) == NULL) {
+    sendanswer(qc, err, strlen(err));
+    return;
+  }
+  if (fmt == NULL) {
+    fmt = ss->subscribers->outputformat;
+  }
+  qc->outq = malloc(SUBQSIZE);
+  qc->outqsize = SUBQSIZE;
+  if ((qc->outq == NULL) || (compilefmt(&qc->cfmt, fmt) != 0)) {
+    err = "ERROR: out of memory\n";
+    sendanswer(qc, err, strlen(err));
+    return;
+  }
+  logaccess((struct sockaddr *)&qc->srcad, qc->adrlen, (char *)qc->inbuf);
+  qc->ss = ss;
+  qc->nextpush = ss->pushconns;
+  ss->pushconns = qc;
+  pushtoqueryconn(qc, time(NULL));
+}
+
+static void metricsprintf(const char * fmt, ...) {
+  va_list ap;
+  int r;
+
+  while (1) {
+    if (metricssize - metricslen > 0) {
+      va_start(ap, fmt);
+      r = vsnprintf(metricsbody + metricslen, metricssize - metricslen, fmt, ap);
+      va_end(ap);
+      if (r < 0) return;
+      if (r < (metricssize - metricslen)) {
+        metricslen += r;
+        return;
+      }
+    }
+    metricssize = (metricssize == 0) ? 16384 : (metricssize * 2);
+    metricsbody = realloc(metricsbody, metricssize);
+    if (metricsbody == NULL) {
+      fprintf(stderr, "ERROR: out of memory.\n");
+      exit(1);
+    }
+  }
+}
+
+static void buildmetrics(time_t now) {
+  static const struct {
+    char * name;
+    char * help;
+    int field; /* ROLL_*, or one of the below */
+  } metrics[] = {
+#define METRIC_CPM60 (NUMROLLFIELDS + 0)
+#define METRIC_RAINTIPS (NUMROLLFIELDS + 1)
+#define METRIC_LASTSEEN (NUMROLLFIELDS + 2)
+    { "foxtemp_temperature_celsius", "Temperature", ROLL_T },
+    { "foxtemp_humidity_percent", "Relative humidity", ROLL_H },
+    { "foxtemp_battery_volts", "Battery voltage", ROLL_V },
+    { "foxtemp_pressure_hpa", "Barometric pressure", ROLL_B },
+    { "foxtemp_pm2_5_ugm3", "Particulate matter 2.5u", ROLL_PM2_5 },
+    { "foxtemp_pm10_ugm3", "Particulate matter 10u", ROLL_PM10 },
+    { "foxtemp_cpm_1m", "Counts per minute, 1 minute average", ROLL_CPM1 },
+    { "foxtemp_cpm_60m", "Counts per minute, 60 minute average", METRIC_CPM60 },
+    { "foxtemp_uv_index", "UV index", ROLL_UV },
+    { "foxtemp_solar_wm2", "Solar intensity", ROLL_SOLAR },
+    { "foxtemp_rain_rate_mmh", "Rain rate", ROLL_RAINRATE },
+    { "foxtemp_rain_tips", "Rain bucket tip counter (7 bit)", METRIC_RAINTIPS },
+    { "foxtemp_last_seen_timestamp_seconds", "When data was last received", METRIC_LASTSEEN }
+  };
+  struct sensorstate * ss;
+  double v[NUMROLLFIELDS];
+  int valid;
+  int m, ti, sid;
+
+  metricslen = 0;
+  metricsexpires = 0;
+  for (m = 0; m < (sizeof(metrics) / sizeof(metrics[0])); m++) {
+    metricsprintf("# TYPE %s gauge\n# HELP %s %s.\n", metrics[m].name,
+                  metrics[m].name, metrics[m].help);
+    for (ti = 0; ti < NUMSENSORTYPES; ti++) {
+      for (sid = 0; sid < 256; sid++) {
+        ss = findsensor(knownsensortypes[ti], sid);
+        if ((ss == NULL) || (ss->lastseen == 0)) continue;
+        if (metrics[m].field == METRIC_LASTSEEN) {
+          metricsprintf("%s{type=\"%c\",id=\"%d\"} %ld\n", metrics[m].name,
+                        ss->sensortype, sid, (long)ss->lastseen);
+          continue;
+        }
+        /* Like everywhere else, stale values are not output */
+        if (validuntil(ss) < now) continue;
+        if ((metricsexpires == 0) || ((validuntil(ss) + 1) < metricsexpires)) {
+          metricsexpires = validuntil(ss) + 1;
+        }
+        if (metrics[m].field == METRIC_CPM60) {
+          if (ss->last.cpm60 == 0xffffff) continue;
+          v[0] = ss->last.cpm60;
+        } else if (metrics[m].field == METRIC_RAINTIPS) {
+          if (ss->last.raintipcount == 0xffffffff) continue;
+          v[0] = ss->last.raintipcount;
+        } else {
+          valid = rollvalues(&ss->last, v);
+          if ((valid & (1 << metrics[m].field)) == 0) continue;
+          v[0] = v[metrics[m].field];
+        }
+        metricsprintf("%s{type=\"%c\",id=\"%d\"} %.3f\n", metrics[m].name,
+                      ss->sensortype, sid, v[0]);
+      }
+    }
+  }
+  metricsprintf("# EOF\n");
+  metricsdirty = 0;
+  metricsdirtyms = 0;
+}
+
+/* Called from the main loop: rebuilds the metrics if they are due.
+ * Returns the number of milliseconds until the next rebuild is due,
+ * or -1 if there is nothing pending. */
+static int refreshmetrics(void) {
+  time_t now = curtime();
+  long long nowms;
+
+  if (metricslistenfd < 0) {
+    return -1;
+  }
+  if ((metricsexpires != 0) && (now >= metricsexpires)) {
+    buildmetrics(now);
+  }
+  if (metricsdirty) {
+    nowms = monotonicms();
+    if (metricsdirtyms == 0) {
+      metricsdirtyms = nowms;
+    }
+    if ((nowms - metricsdirtyms) >= METRICSDELAYMS) {
+      buildmetrics(now);
+    } else {
+      return (int)(METRICSDELAYMS - (nowms - metricsdirtyms));
+    }
+  }
+  if (metricsexpires != 0) {
+    return (metricsexpires - now) * 1000;
+  }
+  return -1;
+}
+
+/* Answers a HTTP request on the metrics port. */
+static void answermetrics(struct queryconn * qc) {
+  char hdr[300];
+  struct iovec iov[2];
+  int hdrlen;
+  int ret;
+  time_t now = curtime();
+
+  if ((strncmp((char *)qc->inbuf, "GET /metrics ", 13) != 0)
+   && (strncmp((char *)qc->inbuf, "GET / ", 6) != 0)) {
+    hdrlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 404 Not Found\r\n"
+                      "Content-Type: text/plain\r\nConnection: close\r\n\r\n"
+                      "Only /metrics is available here.\n");
+    sendanswer(qc, hdr, hdrlen);
+    return;
+  }
+  if (metricsbody == NULL) { /* Not rendered yet */
+    buildmetrics(now);
+  }
+  hdrlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                    "Content-Length: %d\r\nConnection: close\r\n\r\n", metricslen);
+  logaccess((struct sockaddr *)&qc->srcad, qc->adrlen, "metrics");
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = hdrlen;
+  iov[1].iov_base = metricsbody;
+  iov[1].iov_len = metricslen;
+  ret = writev(qc->fd, iov, 2);
+  if (ret < 0) {
+    ret = 0;
+  }
+  if (ret >= (hdrlen + metricslen)) {
+    killqueryconn(qc);
+    return;
+  }
+  /* The socket did not take all of it, the rest has to be queued. */
+  qc->outqsize = hdrlen + metricslen - ret;
+  qc->outq = malloc(qc->outqsize);
+  if (qc->outq == NULL) {
+    killqueryconn(qc);
+    return;
+  }
+  if (ret < hdrlen) {
+    memcpy(qc->outq, hdr + ret, hdrlen - ret);
+    memcpy(qc->outq + hdrlen - ret, metricsbody, metricslen);
+  } else {
+    memcpy(qc->outq, metricsbody + (ret - hdrlen), qc->outqsize);
+  }
+  qc->outqlen = qc->outqsize;
+  flushqueryconn(qc);
+}
+
+/* Returns the position in the history ring of the i-th oldest entry. */
+static unsigned int histpos(struct sensorstate * ss, unsigned int i) {
+  return (ss->histhead + histsize - ss->histcount + i) % histsize;
+}
+
+/* Parses a timestamp in a request. Negative ones are relative to now.
+ * Returns 0 on success. */
+static int parsereqtime(char * s, char ** e, long * v) {
+  *v = strtol(s, e, 10);
+  if (*e == s) return 1;
+  if (*v < 0) *v += time(NULL);
+  return 0;
+}
+
+/* Handles "history <sensor> last <n> [fmt]" and
+ * "history <sensor> since <timestamp> [fmt]". Every entry is rendered into
+ * a line of its own, as if it was the last thing received from the sensor
+ * at that time. Entries received after the request are not included. */
+static void historyquery(struct queryconn * qc) {
+  unsigned char * args;
+  struct sensorstate * ss;
+  struct histcursor * hc;
+  char * err;
+  char * e;
+  unsigned int first, lo, hi;
+  long v;
+
+  if ((ss = parsequery(qc->inbuf + 8, &args, &err)) == NULL) {
+    goto senderr;
+  }
+  err = "ERROR: invalid query\n";
+  if (args == NULL) goto senderr;
+  if (strncmp((char *)args, "last ", 5) == 0) {
+    v = strtol((char *)args + 5, &e, 10);
+    if ((e == (char *)args + 5) || (v < 0)) goto senderr;
+    first = (v >= ss->histcount) ? 0 : (ss->histcount - v);
+  } else if (strncmp((char *)args, "since ", 6) == 0) {
+    if (parsereqtime((char *)args + 6, &e, &v) != 0) goto senderr;
+    /* Find the first entry at or after v */
+    lo = 0; hi = ss->histcount;
+    while (lo < hi) {
+      unsigned int mid = lo + ((hi - lo) / 2);
+      if ((long)ss->histts[histpos(ss, mid)] < v) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    first = lo;
+  } else {
+    goto senderr;
+  }
+  if ((*e != ' ') && (*e != 0)) goto senderr;
+  err = ERRFMTTOOLONG;
+  if ((*e == ' ') && (strlen(e + 1) > MAXFMTLEN)) goto senderr;
+  err = "ERROR: out of memory\n";
+  hc = calloc(sizeof(struct histcursor), 1);
+  if (hc == NULL) goto senderr;
+  if (compilereplayfmt(&hc->fmt, ss, e) != 0) {
+    free(hc);
+    goto senderr;
+  }
+  qc->histcur = hc;
+  qc->outqsize = REPLAYQSIZE;
+  qc->outq = malloc(qc->outqsize);
+  if (qc->outq == NULL) goto senderr; /* hc is freed with qc */
+  hc->ss = ss;
+  initreplaystate(&hc->tmpss, ss);
+  hc->end = ss->histadded;
+  hc->first = hc->end - ss->histcount + first;
+  /* The Davis does not send all its values every time, so for it we need
+   * to go through everything before the first entry as well. */
+  hc->next = (ss->sensortype == 'V') ? (hc->end - ss->histcount) : hc->first;
+  logaccess((struct sockaddr *)&qc->srcad, qc->adrlen, (char *)qc->inbuf);
+  flushqueryconn(qc);
+  return;
+senderr:
+  sendanswer(qc, err, strlen(err));
+}
+
+/* Handles "logdump <sensor> <from> <to> [fmt]": everything in the on-disk
+ * log for the sensor between the two timestamps, rendered like history.
+ * For the Davis, values it did not send since from show as N/A. */
+static void logdumpquery(struct queryconn * qc) {
+  unsigned char * args;
+  struct sensorstate * ss;
+  struct logcursor * lc = NULL;
+  char * err;
+  char * e;
+  long from, to;
+
+  err = "ERROR: no log configured\n";
+  if (logdir == NULL) goto senderr;
+  if ((ss = parsequery(qc->inbuf + 8, &args, &err)) == NULL) {
+    goto senderr;
+  }
+  err = "ERROR: invalid query\n";
+  if (args == NULL) goto senderr;
+  if (parsereqtime((char *)args, &e, &from) != 0) goto senderr;
+  if ((*e != ' ') || (parsereqtime(e + 1, &e, &to) != 0)) goto senderr;
+  if ((*e != ' ') && (*e != 0)) goto senderr;
+  if (from < 0) from = 0;
+  if (to > 0xffffffffL) to = 0xffffffffL;
+  err = ERRFMTTOOLONG;
+  if ((*e == ' ') && (strlen(e + 1) > MAXFMTLEN)) goto senderr;
+  err = "ERROR: out of memory\n";
+  lc = calloc(sizeof(struct logcursor), 1);
+  if (lc == NULL) goto senderr;
+  if (compilereplayfmt(&lc->fmt, ss, e) != 0) {
+    free(lc);
+    goto senderr;
+  }
+  qc->logcur = lc;
+  qc->outqsize = REPLAYQSIZE;
+  qc->outq = malloc(qc->outqsize);
+  if (qc->outq == NULL) goto senderr; /* lc is freed with qc */
+  initreplaystate(&lc->tmpss, ss);
+  lc->from = from;
+  lc->to = to;
+  lc->day = from / 86400;
+  lc->lastday = to / 86400;
+  /* There are no segments before the oldest one, or after today */
+  if (lc->day < oldestlogday) lc->day = oldestlogday;
+  if (lc->lastday > (time(NULL) / 86400)) lc->lastday = time(NULL) / 86400;
+  if ((from > to) || (oldestlogday < 0)) lc->lastday = lc->day - 1;
+  logaccess((struct sockaddr *)&qc->srcad, qc->adrlen, (char *)qc->inbuf);
+  flushqueryconn(qc);
+  return;
+senderr:
+  sendanswer(qc, err, strlen(err));
+}
+
+/* Appends one line for a rollup answer to the output of qc: the start of
+ * the period, then name=min/avg/max/count for every value we have data for.
+ * Needs ROLLUPLINELEN of space. */
+#define ROLLUPLINELEN (12 + (NUMROLLFIELDS * (8 + (3 * FOPMAXLEN) + 11)) + 1)
+static void rollupline(struct queryconn * qc, time_t start, struct rollfield * f) {
+  char * o = qc->outq + qc->outqlen;
+  int len = 0;
+  int i;
+
+  len += bprintf(o + len, ROLLUPLINELEN - len, "%ld", (long)start);
+  for (i = 0; i < NUMROLLFIELDS; i++) {
+    if (f[i].count == 0) continue;
+    len += bprintf(o + len, ROLLUPLINELEN - len, " %s=%.2lf/%.2lf/%.2lf/%lu",
+                   rollfieldnames[i], f[i].min, f[i].sum / f[i].count,
+                   f[i].max, (unsigned long)f[i].count);
+  }
+  len += bprintf(o + len, ROLLUPLINELEN - len, "\n");
+  qc->outqlen += len;
+}
+
+/* Handles "rollup <sensor> <period> <n> [total]": the last n buckets of
+ * period (m, h or d), up to and including the current one, a line for
+ * each. With total, everything in them is added up into one line instead,
+ * which is how to get e.g. the minimum over the last 90 days. */
+static void rollupquery(struct queryconn * qc) {
+  unsigned char * args;
+  struct sensorstate * ss;
+  struct rollbucket * rb;
+  struct rollfield tot[NUMROLLFIELDS];
+  time_t now = time(NULL);
+  time_t totstart = 0;
+  char * err;
+  char * e;
+  int rp, i, j;
+  long n;
+  int total = 0;
+
+  if ((ss = parsequery(qc->inbuf + 7, &args, &err)) == NULL) {
+    goto senderr;
+  }
+  err = "ERROR: rollups are not enabled\n";
+  if (ss->rollups[0] == NULL) goto senderr;
+  err = "ERROR: invalid query\n";
+  if ((args == NULL) || ((rp = parserollperiod(args[0])) < 0)
+   || (args[1] != ' ')) goto senderr;
+  n = strtol((char *)args + 2, &e, 10);
+  if ((e == (char *)args + 2) || (n < 1)) goto senderr;
+  if (strcmp(e, " total") == 0) {
+    total = 1;
+  } else if (*e != 0) {
+    goto senderr;
+  }
+  if (n > rollperiods[rp].nbuckets) n = rollperiods[rp].nbuckets;
+  err = "ERROR: out of memory\n";
+  qc->outqsize = (total ? 1 : n) * ROLLUPLINELEN;
+  qc->outq = malloc(qc->outqsize);
+  if (qc->outq == NULL) goto senderr;
+  memset(tot, 0, sizeof(tot));
+  for (i = n - 1; i >= 0; i--) {
+    if ((rb = getrollbucket(ss, rp, i, now)) == NULL) continue;
+    if (!total) {
+      rollupline(qc, (time_t)rb->start * rollperiods[rp].seconds, rb->f);
+      continue;
+    }
+    if (totstart == 0) totstart = (time_t)rb->start * rollperiods[rp].seconds;
+    for (j = 0; j < NUMROLLFIELDS; j++) {
+      struct rollfield * rf = &rb->f[j];
+      if (rf->count == 0) continue;
+      if ((tot[j].count == 0) || (rf->min < tot[j].min)) tot[j].min = rf->min;
+      if ((tot[j].count == 0) || (rf->max > tot[j].max)) tot[j].max = rf->max;
+      tot[j].sum += rf->sum;
+      tot[j].count += rf->count;
+    }
+  }
+  if (total && (totstart != 0)) {
+    rollupline(qc, totstart, tot);
+  }
+  logaccess((struct sockaddr *)&qc->srcad, qc->adrlen, (char *)qc->inbuf);
+  flushqueryconn(qc);
+  return;
+senderr:
+  sendanswer(qc, err, strlen(err));
+}
+
+static void processqueryconn(struct queryconn * qc, uint32_t events) {
+  int ret;
+  unsigned char * eol;
+
+  if (qc->dead) return;
+  if (qc->outq != NULL) { /* subscriber or longer answer being sent */
+    if (events & EPOLLOUT) {
+      flushqueryconn(qc);
+      if (qc->dead) return;
+    }
+    if (events & (EPOLLHUP | EPOLLERR)) {
+      killqueryconn(qc);
+    } else if (events & EPOLLIN) {
+      /* Anything they send after their request is ignored, we only need
+       * to notice when they go away. */
+      ret = read(qc->fd, qc->inbuf, sizeof(qc->inbuf));
+      if ((ret < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+        killqueryconn(qc);
+      } else if ((ret == 0) && (qc->ss != NULL)) {
+        killqueryconn(qc);
+      } else if (ret == 0) {
+        /* Only their sending side is closed, they still get the rest
+         * of their answer. */
+        qc->rdclosed = 1;
+        qc->wantout = -1; /* makes flushqueryconn() update the events */
+        flushqueryconn(qc);
+      }
+    }
+    return;
+  }
+  ret = read(qc->fd, &qc->inbuf[qc->inlen], sizeof(qc->inbuf) - 1 - qc->inlen);
+  if (ret < 0) {
+    if ((errno == EAGAIN) || (errno == EINTR)) return;
+  } else if (ret > 0) {
+    qc->lastactive = curtime();
+    qc->inlen += ret;
+    qc->inbuf[qc->inlen] = 0;
+    if (qc->ishttp) {
+      /* Wait for the end of the headers, if we closed the connection
+       * before reading everything, the client might never see our answer */
+      if ((strstr((char *)qc->inbuf, "\r\n\r\n") == NULL)
+       && (strstr((char *)qc->inbuf, "\n\n") == NULL)
+       && (qc->inlen < (sizeof(qc->inbuf) - 1))) {
+        return;
+      }
+      answermetrics(qc);
+      return;
+    }
+    eol = (unsigned char *)strpbrk((char *)qc->inbuf, "\r\n");
+    if ((eol == NULL) && (qc->inlen < (sizeof(qc->inbuf) - 1))) {
+      return; /* request not complete yet */
+    }
+    if (eol != NULL) {
+      *eol = 0;
+      if (strncmp((char *)qc->inbuf, "subscribe ", 10) == 0) {
+        subscribequery(qc);
+        return;
+      }
+      if (strncmp((char *)qc->inbuf, "history ", 8) == 0) {
+        historyquery(qc);
+        return;
+      }
+      if (strncmp((char *)qc->inbuf, "logdump ", 8) == 0) {
+        logdumpquery(qc);
+        return;
+      }
+      if (strncmp((char *)qc->inbuf, "rollup ", 7) == 0) {
+        rollupquery(qc);
+        return;
+      }
+    }
+  }
+  /* Either we have a full line, the line is too long, or the client closed
+   * its side of the connection - answer whatever we got, then close. */
+  if ((qc->inlen > 0) && (!qc->ishttp)) {
+    qc->rdclosed = (ret == 0);
+    answerquery(qc);
+  } else {
+    killqueryconn(qc);
+  }
+}
+
+/* Assembles the init string for a receiver into jlinitstr, which must be
+ * as large as rc->initstr. It is assembled in two stages: First the static
+ * part, then the part that depends on settings or sensors.
+ * Returns -1 if the settings are not possible with this receiver. */
+static int buildinitstr(struct receiver * rc, char * jlinitstr,
+                        int havefastsensors, int forcebitrate) {
+
+  /* Static part: */
+  if (rc->type == RECTJEELINK) {
+    strcpy(jlinitstr, "0a "); /* Turn off that annoying ultrabright blue LED */
+  } else if (rc->type == RECTCUL) {
+    strcpy(jlinitstr, "");
+    /* While there is a command to turn off the blinking blue LED on
+     * the CUL (although it's less ultrabright and annoying than the
+     * one on the Jeelink), that command is persistent across reboots
+     * because it writes to the EEPROM. It is therefore recommended
+     * to NOT add it to the initstring because it's only needed once,
+     * and sending it repeatedly will wear down the EEPROM.
+     * Just send it once manually, e.g. with something like
+     * "echo l00 > /dev/ttyACMn" in a terminal. */
+  } else if (rc->type == RECTJEELDAVISV) {
+    strcpy(jlinitstr, "2b"); /* radio band: EU */
+    strcat(jlinitstr, "0d"); /* debug mode: off */
+    strcat(jlinitstr, "0l"); /* activity LED: off */
+    strcat(jlinitstr, "0p"); /* show raw payload data: off */
+    strcat(jlinitstr, "1r"); /* receive mode: enable */
+  }
+  /* dynamic part: */
+  if (rc->type == RECTJEELINK) {
+    if (forcebitrate == 0) {
+      if (havefastsensors) { /* do we have at least 1 sensor that could use the faster rate of 17241? */
+        strcat(jlinitstr, "30t "); /* Set to automatically switch data rate every 30 seconds */
+      } else {
+        strcat(jlinitstr, "1r "); /* Fixed slow rate of 9579 */
+      }
+    } else if (forcebitrate < 0) {
+      strcat(jlinitstr, "30t "); /* Set to automatically switch data rate every 30 seconds */
+    } else if (forcebitrate == 9579) {
+      strcat(jlinitstr, "1r "); /* Fixed slow rate of 9579 */
+    } else if (forcebitrate == 17241) {
+      strcat(jlinitstr, "0r "); /* Fixed fast rate of 17241 */
+    } else {
+      fprintf(stderr, "WARNING: Don't know how to do a bitrate of %d, ignoring bitrate setting!\n", forcebitrate);
+    }
+    strcat(jlinitstr, "?"); /* show firmware version */
+  } else if (rc->type == RECTCUL) {
+    if (forcebitrate <= 0) {
+      fprintf(stderr, "ERROR: with CUL as a receiver, you currently need to specify a fixed bitrate, as it cannot automatically switch.\n");
+      return -1;
+    } else if (forcebitrate == 9579) {
+      strcat(jlinitstr, "Nr2\r\n");
+    } else if (forcebitrate == 17241) {
+      strcat(jlinitstr, "Nr1\r\n");
+    } else {
+      fprintf(stderr, "ERROR: Don't know how to program a bitrate of %d into CUL!\n", forcebitrate);
+      return -1;
+    }
+    strcat(jlinitstr, "V\r\nVH\r\n"); /* show firmware and hardware version */
+    /* If you have problems with the reception, you can try playing around with
+     * the Automatic Gain settings in the AGCTRL0-2 registers. See the datasheet
+     * of the CC1101 for details.
+     * The settings we set here worked best _for me_. However, since this chip
+     * seems to be _extremely_ finicky, YMMV. */
+    /* AGCTRL2 (register 0x1B) sets (among other things) the target amplitude.
+     * According to culfw documentation, the default value should be 0x07, but
+     * in the 'native mode' we use, the firmware sets it to 0x43 instead -
+     * which disallows the highest gain setting.
+     * Values probably worth trying: 07 - target amplitude 42 dB;
+     * 47 / 43 - TA 42 dB / 33 dB, highest DVGA gain disallowed */
+    strcat(jlinitstr, "Cw1b07\r\n");
+    /* AGCTRL1 (register 0x1C) sets (among other things) strategies for AGC.
+     * default set by the firmware in native mode is 0x68, which selects
+     * "strategy 1" with a relative carrier detection threshold of 10 dB
+     * relative RSSI increase and disabled absolute c.d.t..
+     * Value definitely worth trying: 40 which is the poweron-default of the
+     * chip and worked really well in one case. */
+    strcat(jlinitstr, "Cw1c00\r\n");
+    /* AGCTRL0 (register 0x1D) sets (among other things) the decision boundary.
+     * the default value is 0x91 which selects 8db decision boundary.
+     * this value is not touched by the firmware in native mode, so has the
+     * poweron default value. */
+    strcat(jlinitstr, "Cw1d81\r\n");
+    /* Show values of AGCTRL2-AGCTRL0 registers */
+    /*strcat(jlinitstr, "C1b\r\nC1c\r\nC1d\r\n"); */
+  } else if (rc->type == RECTJEELDAVISV) {
+    int i;
+    /* FIXME: this really should to be modifyable on the commandline.
+     * as should the station type below. */
+    strcat(jlinitstr, "300h"); /* height above sealevel in m: 300 */
+    for (i = 0; i < 256; i++) {
+      if (findsensor('V', i) != NULL) {
+        sprintf(&jlinitstr[strlen(jlinitstr)], "%d,0s", i);
+      }
+    }
+    strcat(jlinitstr, "v");
+  }
+  VERBPRINT(4, "Assembled initstring for %s is: %s\n", rc->devname, jlinitstr);
+  return 0;
+}
+
+/* Opens a TCP listening socket on port (IPv6, with v4 mapped addresses).
+ * Returns -1 if that failed. */
+static int openlistener(unsigned int port) {
+  struct sockaddr_in6 soa;
+  int fd; int optval;
+
+  fd = socket(PF_INET6, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket() failed");
+    return -1;
+  }
+  memset(&soa, 0, sizeof(soa));
+  soa.sin6_family = AF_INET6;
+  soa.sin6_addr = in6addr_any;
+  soa.sin6_port = htons(port);
+  optval = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval))) {
+    VERBPRINT(0, "WARNING: failed to setsockopt REUSEADDR: %s", strerror(errno));
+  }
+#ifdef BRAINDEADOS
+  /* For braindead operating systems in default config (BSD, Windows,
+   * newer Debian), we need to tell the OS that we're actually fine with
+   * accepting V4 mapped addresses as well. Because apparently for
+   * braindead idiots accepting only selected addresses is a more default
+   * case than accepting everything. */
+  optval = 0;
+  if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof(optval))) {
+    VERBPRINT(0, "WARNING: failed to setsockopt IPV6_V6ONLY: %s", strerror(errno));
+  }
+#endif
+  if (bind(fd, (struct sockaddr *)&soa, sizeof(soa)) < 0) {
+    perror("Bind failed");
+    printf("Could not bind to port %u\n", port);
+    close(fd);
+    return -1;
+  }
+  if (listen(fd, 20) < 0) { /* Large Queue as we might block for some time while reading */
+    perror("Listen failed");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* The configuration file (-c) contains lines of "<key> <value>", with the
+ * same meaning as the corresponding command line options:
+ *   receiver [jeelink:|cul:|davis:]<device>   (-d, can be repeated)
+ *   bitrate <n>                               (-r)
+ *   queryport <port>                          (-Q)
+ *   metricsport <port>                        (-P)
+ *   statsport <port>                          (-S)
+ *   sensor <daemon parameter>                 (can be repeated)
+ * Empty lines and lines starting with # are ignored. What is not set in the
+ * file keeps the value from the command line, sensors given on the command
+ * line are served in addition to those from the file. On SIGHUP, the file
+ * is read again. */
+struct daemonconfig {
+  int forcebitrate;
+  unsigned int queryport;
+  unsigned int metricsport;
+  unsigned int statsport;
+  char ** receivers;
+  int nreceivers;
+  char ** sensors;
+  int nsensors;
+};
+static char * configfile = NULL;
+static struct daemonconfig cmdlineconfig;
+static struct daemonconfig runningconfig;
+static volatile sig_atomic_t reloadrequested = 0;
+
+static void sighuphandler(int sig) {
+  reloadrequested = 1;
+}
+
+static void addconfigstr(char *** list, int * n, char * str) {
+  *list = realloc(*list, (*n + 1) * sizeof(char *));
+  if ((*list == NULL) || (((*list)[*n] = strdup(str)) == NULL)) {
+    fprintf(stderr, "ERROR: out of memory.\n");
+    exit(1);
+  }
+  (*n)++;
+}
+
+static void freeconfig(struct daemonconfig * cfg) {
+  int i;
+
+  for (i = 0; i < cfg->nreceivers; i++) free(cfg->receivers[i]);
+  for (i = 0; i < cfg->nsensors; i++) free(cfg->sensors[i]);
+  free(cfg->receivers);
+  free(cfg->sensors);
+  memset(cfg, 0, sizeof(struct daemonconfig));
+}
+
+/* Reads the configuration file fn (if not NULL) on top of the command line
+ * settings. Returns -1 after telling why if that failed. */
+static int readconfig(char * fn, struct daemonconfig * cfg) {
+  FILE * f;
+  char * line = NULL;
+  size_t linesize = 0;
+  char * key;
+  char * val;
+  int lineno = 0;
+  int i;
+
+  memset(cfg, 0, sizeof(struct daemonconfig));
+  cfg->forcebitrate = cmdlineconfig.forcebitrate;
+  cfg->queryport = cmdlineconfig.queryport;
+  cfg->metricsport = cmdlineconfig.metricsport;
+  cfg->statsport = cmdlineconfig.statsport;
+  for (i = 0; i < cmdlineconfig.nsensors; i++) {
+    addconfigstr(&cfg->sensors, &cfg->nsensors, cmdlineconfig.sensors[i]);
+  }
+  if (fn == NULL) goto done;
+  if ((f = fopen(fn, "r")) == NULL) {
+    fprintf(stderr, "ERROR: Could not open config file %s (%s).\n", fn, strerror(errno));
+    return -1;
+  }
+  while (getline(&line, &linesize, f) >= 0) {
+    lineno++;
+    line[strcspn(line, "\r\n")] = 0;
+    key = line + strspn(line, " \t");
+    if ((*key == 0) || (*key == '#')) continue;
+    val = key + strcspn(key, " \t");
+    if (*val != 0) {
+      *val = 0;
+      val++;
+      val += strspn(val, " \t");
+    }
+    if (*val == 0) {
+      fprintf(stderr, "ERROR: %s line %d: '%s' requires a value.\n", fn, lineno, key);
+      goto err;
+    }
+    if (strcmp(key, "receiver") == 0) {
+      addconfigstr(&cfg->receivers, &cfg->nreceivers, val);
+    } else if (strcmp(key, "sensor") == 0) {
+      addconfigstr(&cfg->sensors, &cfg->nsensors, val);
+    } else if (strcmp(key, "bitrate") == 0) {
+      cfg->forcebitrate = strtol(val, NULL, 10);
+      if (cfg->forcebitrate == 1) { cfg->forcebitrate = 9579; }
+      if (cfg->forcebitrate == 2) { cfg->forcebitrate = 17241; }
+    } else if (strcmp(key, "queryport") == 0) {
+      cfg->queryport = strtoul(val, NULL, 10);
+    } else if (strcmp(key, "metricsport") == 0) {
+      cfg->metricsport = strtoul(val, NULL, 10);
+    } else if (strcmp(key, "statsport") == 0) {
+      cfg->statsport = strtoul(val, NULL, 10);
+    } else {
+      fprintf(stderr, "ERROR: %s line %d: unknown setting '%s'.\n", fn, lineno, key);
+      goto err;
+    }
+  }
+  free(line);
+  fclose(f);
+done:
+  /* Receivers from the file replace those from the command line */
+  if (cfg->nreceivers == 0) {
+    for (i = 0; i < cmdlineconfig.nreceivers; i++) {
+      addconfigstr(&cfg->receivers, &cfg->nreceivers, cmdlineconfig.receivers[i]);
+    }
+  }
+  return 0;
+err:
+  free(line);
+  fclose(f);
+  freeconfig(cfg);
+  return -1;
+}
+
+/* Parses a daemon parameter "[sensortype]sensorid[:port[:outputformat]]".
+ * The result does not serve anything yet, see servesensor(). Returns NULL
+ * after telling why if the parameter is invalid. */
+static struct daemondata * parsedaemonparam(char * param, struct daemonconfig * cfg) {
+  struct daemondata * dd;
+  unsigned char sensorid[1000];
+  int l;
+
+  dd = calloc(sizeof(struct daemondata), 1);
+  if ((dd == NULL) || ((dd->param = strdup(param)) == NULL)) {
+    fprintf(stderr, "ERROR: out of memory.\n");
+    exit(1);
+  }
+  dd->fd = -1;
+  l = sscanf(param, "%999[^:]:%u:%999[^\n]",
+             sensorid, &dd->port, &dd->outputformat[0]);
+  if (l < 1) {
+    fprintf(stderr, "ERROR: failed to parse daemon command parameter '%s'\n", param);
+    goto err;
+  }
+  if (l == 1) {
+    dd->port = 0;
+  }
+  if (l <= 2) {
+    strcpy((char *)&dd->outputformat[0], "%S %T");
+  }
+  if (parsesensorkey(sensorid, &dd->stype, &dd->sid, NULL) != 0) {
+    fprintf(stderr, "ERROR: Unknown sensortype selected in daemon parameter '%s'.\n", param);
+    goto err;
+  }
+  if ((dd->port == 0) && (cfg->queryport == 0) && (cfg->metricsport == 0)
+   && (mcastdest == NULL) && (shmname == NULL)) {
+    fprintf(stderr, "ERROR: daemon parameter '%s' has no port, that is only allowed with a query port (-Q), metrics port (-P), multicast (-M) or shared memory (-m).\n", param);
+    goto err;
+  }
+  if (compilefmt(&dd->cfmt, &dd->outputformat[0]) != 0) {
+    fprintf(stderr, "ERROR: out of memory.\n");
+    exit(1);
+  }
+  if (dd->cfmt.maxlen >= OUTBUFSIZE) {
+    VERBPRINT(0, "WARNING: output for daemon parameter '%s' might get cut off after %d characters.\n",
+                 param, OUTBUFSIZE - 1);
+  }
+  return dd;
+err:
+  free(dd->param);
+  free(dd);
+  return NULL;
+}
+
+/* Makes dd serve its sensor. */
+static void servesensor(struct daemondata * dd) {
+  dd->ss = getsensorstate(dd->stype, dd->sid);
+  if ((dd->ss->subscribers == NULL) && (shmtable != NULL)) {
+    getshmslot(dd->stype, dd->sid)->sensortype = dd->stype;
+    getshmslot(dd->stype, dd->sid)->sensorid = dd->sid;
+  }
+  dd->nextforsensor = dd->ss->subscribers;
+  dd->ss->subscribers = dd;
+  updatecachedout(dd, time(NULL));
+}
+
+/* Stops serving and frees dd. If that was the last one for its sensor, the
+ * sensor is no longer served, but its state is kept in case it returns. */
+static void freedaemondata(struct daemondata * dd) {
+  struct daemondata ** pdd;
+  struct sensorstate * ss = dd->ss;
+
+  if (ss != NULL) {
+    for (pdd = &ss->subscribers; *pdd != NULL; pdd = &(*pdd)->nextforsensor) {
+      if (*pdd == dd) {
+        *pdd = dd->nextforsensor;
+        break;
+      }
+    }
+    if (ss->subscribers == NULL) {
+      ss->retired = 1;
+      while (ss->pushconns != NULL) {
+        killqueryconn(ss->pushconns);
       }
-      /* Open the port */
-      mydaemondata->fd = socket(PF_INET6, SOCK_STREAM, 0);
-      soa.sin6_family = AF_INET6;
-      soa.sin6_addr = in6addr_any;
-      soa.sin6_port = htons(mydaemondata->port);
-      optval = 1;
-      if (setsockopt(mydaemondata->fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval))) {
-        VERBPRINT(0, "WARNING: failed to setsockopt REUSEADDR: %s", strerror(errno));
+      if (shmtable != NULL) {
+        struct foxtempshmslot * slot = getshmslot(ss->sensortype, ss->sensorid);
+        uint32_t seq = slot->seq;
+        __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        slot->sensortype = 0;
+        __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
       }
-#ifdef BRAINDEADOS
-      /* For braindead operating systems in default config (BSD, Windows,
-       * newer Debian), we need to tell the OS that we're actually fine with
-       * accepting V4 mapped addresses as well. Because apparently for
-       * braindead idiots accepting only selected addresses is a more default
-       * case than accepting everything. */
-      optval = 0;
-      if (setsockopt(mydaemondata->fd, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof(optval))) {
-        VERBPRINT(0, "WARNING: failed to setsockopt IPV6_V6ONLY: %s", strerror(errno));
+    }
+  }
+  if (dd->fd >= 0) {
+    close(dd->fd);
+  }
+  freecompiledfmt(&dd->cfmt);
+  free(dd->param);
+  free(dd);
+}
+
+/* Whether any of the sensors served could use the faster data rate. */
+static int havefastsensors(struct daemondata * dd) {
+  for (; dd != NULL; dd = dd->next) {
+    switch (dd->stype) {
+    case 'F':
+    case 'G':
+    case 'L':
+    case 'S': /* these often use the faster data rate */
+              return 1;
+    };
+  }
+  return 0;
+}
+
+static struct evhandle queryevh;
+static struct evhandle metricsevh;
+static struct evhandle statsevh;
+
+/* Moves the query, metrics or stats listener from port oldport to newport. */
+static void movelistener(int * fd, unsigned int oldport, unsigned int newport,
+                         struct evhandle * evh) {
+  if (newport == oldport) return;
+  if (*fd >= 0) {
+    close(*fd); /* that also removes it from epoll */
+    *fd = -1;
+  }
+  if (newport != 0) {
+    if ((*fd = openlistener(newport)) >= 0) {
+      epolladd(epfd, *fd, evh);
+    }
+  }
+}
+
+/* Reads the configuration file again, and applies the differences to the
+ * running daemon: only ports that were added, removed or changed are
+ * closed or opened, sensors that are still served keep their state, and
+ * the receivers only get a new init string if it actually changed.
+ * Returns the new list of daemondata. */
+static struct daemondata * reloadconfig(struct daemondata * dd) {
+  struct daemonconfig cfg;
+  struct daemondata * newdds = NULL;
+  struct daemondata * kept = NULL;
+  struct daemondata * cur, * next, * old, ** pold;
+  struct receiver * rc;
+  char initstr[sizeof(rc->initstr)];
+  int i;
+
+  VERBPRINT(0, "Reloading configuration from %s\n", configfile);
+  if (readconfig(configfile, &cfg) != 0) {
+    fprintf(stderr, "WARNING: not reloading, keeping the old configuration.\n");
+    return dd;
+  }
+  /* Parse everything first, so nothing changes if there is an error. */
+  for (i = cfg.nsensors - 1; i >= 0; i--) {
+    if ((cur = parsedaemonparam(cfg.sensors[i], &cfg)) == NULL) {
+      fprintf(stderr, "WARNING: not reloading, keeping the old configuration.\n");
+      while (newdds != NULL) {
+        next = newdds->next;
+        freedaemondata(newdds);
+        newdds = next;
       }
-#endif
-      if (bind(mydaemondata->fd, (struct sockaddr *)&soa, sizeof(soa)) < 0) {
-        perror("Bind failed");
-        printf("Could not bind to port %u\n", mydaemondata->port);
+      freeconfig(&cfg);
+      return dd;
+    }
+    cur->next = newdds;
+    newdds = cur;
+  }
+  if (cfg.nreceivers != runningconfig.nreceivers) {
+    fprintf(stderr, "WARNING: changes to the receivers need a restart.\n");
+  } else {
+    for (i = 0; i < cfg.nreceivers; i++) {
+      if (strcmp(cfg.receivers[i], runningconfig.receivers[i]) != 0) {
+        fprintf(stderr, "WARNING: changes to the receivers need a restart.\n");
+        break;
+      }
+    }
+  }
+  /* Keep everything that did not change at all. */
+  for (cur = newdds, newdds = NULL; cur != NULL; cur = next) {
+    next = cur->next;
+    for (pold = &dd; *pold != NULL; pold = &(*pold)->next) {
+      if (strcmp((*pold)->param, cur->param) == 0) break;
+    }
+    if (*pold != NULL) {
+      old = *pold;
+      *pold = old->next;
+      old->next = kept;
+      kept = old;
+      freedaemondata(cur);
+    } else {
+      cur->next = newdds;
+      newdds = cur;
+    }
+  }
+  /* Start serving what is new. A port that is still used, just with a
+   * different sensor or outputformat, is taken over instead of reopened. */
+  for (cur = newdds; cur != NULL; cur = next) {
+    next = cur->next;
+    servesensor(cur);
+    cur->evh.evtype = EVT_SENSORLISTEN;
+    cur->evh.obj = cur;
+    if (cur->port == 0) continue;
+    for (old = dd; old != NULL; old = old->next) {
+      if ((old->port == cur->port) && (old->fd >= 0)) break;
+    }
+    if (old != NULL) {
+      struct epoll_event ev;
+      cur->fd = old->fd;
+      old->fd = -1;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.ptr = &cur->evh;
+      epoll_ctl(epfd, EPOLL_CTL_MOD, cur->fd, &ev);
+    } else if ((cur->fd = openlistener(cur->port)) >= 0) {
+      epolladd(epfd, cur->fd, &cur->evh);
+    }
+    VERBPRINT(1, "Now serving '%s'\n", cur->param);
+  }
+  /* Whatever is left over in the old list is gone. */
+  for (old = dd; old != NULL; old = next) {
+    next = old->next;
+    VERBPRINT(1, "No longer serving '%s'\n", old->param);
+    freedaemondata(old);
+  }
+  /* Append kept ones to the new ones */
+  if (newdds == NULL) {
+    newdds = kept;
+  } else {
+    for (cur = newdds; cur->next != NULL; cur = cur->next) { }
+    cur->next = kept;
+  }
+  movelistener(&querylistenfd, queryport, cfg.queryport, &queryevh);
+  movelistener(&metricslistenfd, metricsport, cfg.metricsport, &metricsevh);
+  movelistener(&statslistenfd, statsport, cfg.statsport, &statsevh);
+  queryport = cfg.queryport;
+  metricsport = cfg.metricsport;
+  statsport = cfg.statsport;
+  metricsdirty = 1;
+  /* Only bother the receivers if their settings changed. */
+  for (rc = receivers; rc != NULL; rc = rc->next) {
+    if (buildinitstr(rc, initstr, havefastsensors(newdds), cfg.forcebitrate) != 0) {
+      fprintf(stderr, "WARNING: keeping the old radio settings for %s.\n", rc->devname);
+      continue;
+    }
+    /* Only the main thread ever changes initstr, so reading it unlocked is
+     * fine here. The reading thread may be resending it right now though. */
+    if (strcmp(initstr, rc->initstr) == 0) continue;
+    VERBPRINT(1, "Radio settings changed, sending new init-string to %s\n", rc->devname);
+    pthread_mutex_lock(&rc->initlock);
+    strcpy(rc->initstr, initstr);
+    if (write(rc->fd, rc->initstr, strlen(rc->initstr)) != strlen(rc->initstr)) {
+      fprintf(stderr, "WARNING: init-string was not sent to the receiver on %s successfully.\n", rc->devname);
+    }
+    rc->lastsentinit = time(NULL);
+    pthread_mutex_unlock(&rc->initlock);
+  }
+  cfg.nreceivers = runningconfig.nreceivers; /* those are still in use */
+  cfg.receivers = runningconfig.receivers;
+  runningconfig.receivers = NULL;
+  runningconfig.nreceivers = 0;
+  freeconfig(&runningconfig);
+  runningconfig = cfg;
+  return newdds;
+}
+
+#define MAXEVENTS 64
+static void dodaemon(struct daemondata * dd, char ** argv) {
+  struct epoll_event evs[MAXEVENTS];
+  time_t lastsweep = 0;
+  struct daemondata * curdd;
+  struct receiver * rc;
+  int readysocks;
+  int timeout;
+  int ret;
+  int i;
+
+  /* All our fds are registered exactly once, so a wakeup only costs us
+   * the fds that are actually ready, no matter how many ports we serve. */
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    perror("ERROR: epoll_create1() failed");
+    exit(1);
+  }
+  for (rc = receivers; rc != NULL; rc = rc->next) {
+    rc->evh.evtype = EVT_SERIAL;
+    rc->evh.obj = rc;
+    rc->lastdatarecv = time(NULL);
+    startserialthread(rc);
+    epolladd(epfd, rc->evfd, &rc->evh);
+  }
+  curdd = dd;
+  while (curdd != NULL) {
+    curdd->evh.evtype = EVT_SENSORLISTEN;
+    curdd->evh.obj = curdd;
+    if (curdd->fd >= 0) {
+      epolladd(epfd, curdd->fd, &curdd->evh);
+    }
+    curdd = curdd->next;
+  }
+  statsevh.evtype = EVT_STATSLISTEN;
+  if (statslistenfd >= 0) {
+    epolladd(epfd, statslistenfd, &statsevh);
+  }
+  metricsevh.evtype = EVT_METRICSLISTEN;
+  if (metricslistenfd >= 0) {
+    epolladd(epfd, metricslistenfd, &metricsevh);
+    buildmetrics(curtime());
+  }
+  queryevh.evtype = EVT_QUERYLISTEN;
+  if (querylistenfd >= 0) {
+    epolladd(epfd, querylistenfd, &queryevh);
+  }
+  while (1) {
+    /* Wake up regularly, so timeouts get noticed, and in time for
+     * the next metrics rebuild. */
+    timeout = 5000;
+    ret = refreshmetrics();
+    if ((ret >= 0) && (ret < timeout)) {
+      timeout = ret;
+    }
+    if ((readysocks = epoll_wait(epfd, evs, MAXEVENTS, timeout)) < 0) { /* Error?! */
+      if (errno != EINTR) {
+        perror("ERROR: error on epoll_wait()");
+        dotryrestart(dd, argv);
+      }
+      readysocks = 0;
+    }
+    for (i = 0; i < readysocks; i++) {
+      struct evhandle * evh = evs[i].data.ptr;
+      if (evh->evtype == EVT_SERIAL) {
+        processserialdata(evh->obj, dd, argv);
+      } else if (evh->evtype == EVT_SENSORLISTEN) {
+        struct queryconn * qc;
+        curdd = evh->obj;
+        if ((qc = acceptqueryconn(curdd->fd)) != NULL) {
+          int outlen;
+          char * outbuf = getcachedout(curdd, &outlen);
+          curdd->ss->nqueries++;
+          logaccess((struct sockaddr *)&qc->srcad, qc->adrlen, outbuf);
+          sendanswer(qc, outbuf, outlen);
+        }
+      } else if (evh->evtype == EVT_QUERYLISTEN) {
+        acceptqueryconn(querylistenfd);
+      } else if (evh->evtype == EVT_METRICSLISTEN) {
+        acceptqueryconn(metricslistenfd);
+      } else if (evh->evtype == EVT_STATSLISTEN) {
+        acceptqueryconn(statslistenfd);
+      } else if (evh->evtype == EVT_QUERYCONN) {
+        processqueryconn(evh->obj, evs[i].events);
+      }
+    }
+    if ((time(NULL) - lastsweep) >= 5) {
+      sweepqueryconns(time(NULL));
+      lastsweep = time(NULL);
+    }
+    freedeadqueryconns();
+    if (reloadrequested) {
+      reloadrequested = 0;
+      dd = reloadconfig(dd);
+    }
+    if (restartonerror) {
+      /* Did we receive something on all serial ports recently? */
+      for (rc = receivers; rc != NULL; rc = rc->next) {
+        if ((time(NULL) - RCREAD(rc, lastdatarecv)) > 300) {
+          fprintf(stderr, "Timeout: No data from serial port %s for 5 minutes.\n", rc->devname);
+          dotryrestart(dd, argv);
+        }
+      }
+    }
+  }
+  /* never reached */
+}
+
+
+/* Replays a captured serial stream from fn ("-" for stdin) through the same
+ * code that handles data from the serial port in daemon mode. Lines can be
+ * prefixed with "@<unix timestamp> " to set the clock, otherwise it stays
+ * at the last timestamp seen, so the result does not depend on when or how
+ * fast this runs. Without realtime, everything is processed as fast as
+ * possible, with it, we wait as long as the timestamps say. */
+#define REPLAYSTARTTIME 1000000000
+static void doreplay(char * fn, int realtime) {
+  FILE * f;
+  char * line = NULL;
+  size_t linesize = 0;
+  ssize_t len;
+  struct receiver rc;
+  struct sensorstate * ss;
+  struct compiledfmt cf;
+  char outbuf[OUTBUFSIZE];
+  double lastts = -1.0;
+  long nlines = 0;
+  long nbytes = 0;
+  long long starttime;
+  double elapsed;
+  int ti, sid;
+
+  if (strcmp(fn, "-") == 0) {
+    f = stdin;
+  } else if ((f = fopen(fn, "r")) == NULL) {
+    fprintf(stderr, "ERROR: Could not open %s (%s).\n", fn, strerror(errno));
+    exit(1);
+  }
+  memset(&rc, 0, sizeof(rc));
+  rc.devname = (unsigned char *)fn;
+  rc.type = receivertype;
+  rc.fd = -1;
+  replayclock = REPLAYSTARTTIME;
+  rc.lastsentinit = replayclock;
+  starttime = monotonicms();
+  while ((len = getline(&line, &linesize, f)) > 0) {
+    char * p = line;
+    if (line[0] == '@') {
+      char * e;
+      double ts = strtod(line + 1, &e);
+      if ((e != (line + 1)) && (ts >= 1.0)) {
+        if (realtime && (lastts >= 0.0) && (ts > lastts)) {
+          struct timespec slp;
+          slp.tv_sec = (time_t)(ts - lastts);
+          slp.tv_nsec = (long)(((ts - lastts) - slp.tv_sec) * 1e9);
+          nanosleep(&slp, NULL);
+        }
+        lastts = ts;
+        replayclock = (time_t)ts;
+        if (*e == ' ') e++;
+        len -= (e - line);
+        p = e;
+      }
+    }
+    processserialbytes(&rc, (unsigned char *)p, len);
+    nlines++;
+    nbytes += len;
+  }
+  processserialbytes(&rc, (unsigned char *)"\n", 1); /* in case the last line had none */
+  elapsed = (monotonicms() - starttime) / 1000.0;
+  free(line);
+  if (f != stdin) fclose(f);
+  /* Dump the final state of everything, for comparing it to earlier runs. */
+  compilefmt(&cf, (unsigned char *)"%L %T %H %V %B %PM2.5u %PM10u %c %C %UV %UI %RR %RT");
+  for (ti = 0; ti < NUMSENSORTYPES; ti++) {
+    for (sid = 0; sid < 256; sid++) {
+      if ((ss = sensorindex[ti][sid]) == NULL) continue;
+      renderfmt(outbuf, sizeof(outbuf), &cf, ss,
+                (ss->lastseen != 0) ? ss->lastseen : replayclock);
+      printf("%c%d %s interval=%ld missed=%lu\n", ss->sensortype, sid, outbuf,
+             (long)ss->interval, ss->nmissed);
+    }
+  }
+  freecompiledfmt(&cf);
+  fprintf(stderr, "Replayed %ld lines (%ld bytes) in %.3f seconds, %.0f lines/s\n",
+          nlines, nbytes, elapsed, (elapsed > 0.0) ? (nlines / elapsed) : 0.0);
+}
+
+/* Micro-benchmarks for the hot path: parsing, decoding and rendering. The
+ * example lines are the ones from the comments at the parsers. Every
+ * measurement runs a fixed number of times, so the table always has the
+ * same layout and can be compared between versions. */
+#define BENCHITERATIONS 500000
+static long long benchns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((long long)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
+/* The sscanf() that split JeeLink lines before tokenizejeelinkline(), kept
+ * only so the benchmark can show the difference. */
+static int benchsscanfline(char * line, unsigned int * vals) {
+  char isok[1000], rtype[1000];
+  return sscanf(line, "%s %s %u %u %u %u %u %u %u %u %u %u %u %u %u %u %u",
+                &isok[0], &rtype[0], &vals[0], &vals[1], &vals[2], &vals[3],
+                &vals[4], &vals[5], &vals[6], &vals[7], &vals[8], &vals[9],
+                &vals[10], &vals[11], &vals[12], &vals[13], &vals[14]);
+}
+
+static void dobench(void) {
+  static const struct {
+    int rtype;
+    char * name;
+    char * line;
+  } lines[] = {
+    { RECTJEELINK, "JeeLink H hawotempdev2016", "OK CC 7 23 144 34 53 133" },
+    { RECTJEELINK, "JeeLink F foxtempdev2016", "OK CC 8 247 98 194 159 169 198" },
+    { RECTJEELINK, "JeeLink L lacrosse", "OK 9 9 1 4 194 32" },
+    { RECTJEELINK, "JeeLink S foxstaub2018", "OK CC 7 245 1 151 87 51 120 96 97 0 33 0 95 0" },
+    { RECTJEELINK, "JeeLink G foxgeig2018", "OK CC 2 249 0 0 34 0 0 26 157" },
+    { RECTJEELINK, "JeeLink D hawotempdev2018", "OK CC 7 253 99 175 152 104 230 119 60 62" },
+    { RECTJEELINK, "JeeLink garbage", "OK CC 15 247 98 x 159 169 198" },
+    { RECTCUL, "CUL F foxtempdev2016", "N02CC3A06F7604A9332EC0A04F6CCAB4D3058D5C5769932D398" },
+    { RECTCUL, "CUL L lacrosse", "N019CC4503651AAAA000381FFEB" },
+    { RECTCUL, "CUL F bad CRC", "N02CC3A06F7604A9332EC0B04F6CCAB4D3058D5C5769932D398" },
+    { RECTJEELDAVISV, "Davis V hum/wind", "OK VALUES DAVIS 5 Channel=1,RSSI=-59,Battery=ok,WindSpeed=0.00,WindDirection=0,Humidity=87.00," },
+    { RECTJEELDAVISV, "Davis V temp/UV/solar/rain", "OK VALUES DAVIS 6 Channel=1,Temperature=21.50,Battery=low,UV=24,Solar=99,RainSecs=60,RainTipCount=17" }
+  };
+  static const struct {
+    char * sensor;
+    char * fmt;
+  } fmts[] = {
+    { "F8", "%S %T" },
+    { "F8", "%S %T %H %V" },
+    { "F8", "%L %t %h %f %V%n" },
+    { "S7", "%T %H %B %PM2.5u %PM10u %V" },
+    { "V6", "%T %H %UV %UI %RR %RT %V" },
+    { "F8", "%AmnT %AmxT %AmaT %AhaH %AdcT" }
+  };
+  struct receiver rc;
+  struct rxframe f;
+  struct sensorstate * ss;
+  struct compiledfmt cf;
+  char outbuf[OUTBUFSIZE];
+  unsigned char stype, sid;
+  unsigned char * rtype;
+  unsigned int vals[JLMAXVALS];
+  int rtlen;
+  unsigned long sink = 0;
+  long long t0, tparse, tfull;
+  int i, j, ok;
+
+  trackallsensors = 1;
+  userollups = 1;
+  memset(&rc, 0, sizeof(rc));
+  rc.devname = (unsigned char *)"bench";
+  rc.fd = -1;
+  printf("%-28s %3s %12s %12s\n", "line", "ok", "parse ns", "total ns");
+  for (i = 0; i < (sizeof(lines) / sizeof(lines[0])); i++) {
+    unsigned char * l = (unsigned char *)lines[i].line;
+    rc.type = lines[i].rtype;
+    ok = (rc.type == RECTJEELDAVISV) ? parsedavisline(l, &f)
+       : ((rc.type == RECTCUL) ? parseculline(l, &f) : parsejeelinkline(l, &f));
+    t0 = benchns();
+    for (j = 0; j < BENCHITERATIONS; j++) {
+      if (rc.type == RECTJEELDAVISV) {
+        sink += parsedavisline(l, &f);
+      } else if (rc.type == RECTCUL) {
+        sink += parseculline(l, &f);
+      } else {
+        sink += parsejeelinkline(l, &f);
+      }
+    }
+    tparse = benchns() - t0;
+    t0 = benchns();
+    for (j = 0; j < BENCHITERATIONS; j++) {
+      parseserialline(&rc, l);
+    }
+    tfull = benchns() - t0;
+    printf("%-28s %3s %12.1f %12.1f\n", lines[i].name, ((ok > 0) ? "yes" : "no"),
+           (double)tparse / BENCHITERATIONS, (double)tfull / BENCHITERATIONS);
+  }
+  printf("\n%-28s %3s %12s %12s\n", "JeeLink line split", "", "sscanf ns", "tokenize ns");
+  for (i = 0; i < (sizeof(lines) / sizeof(lines[0])); i++) {
+    if (lines[i].rtype != RECTJEELINK) continue;
+    t0 = benchns();
+    for (j = 0; j < BENCHITERATIONS; j++) {
+      sink += benchsscanfline(lines[i].line, vals);
+    }
+    tparse = benchns() - t0;
+    t0 = benchns();
+    for (j = 0; j < BENCHITERATIONS; j++) {
+      sink += tokenizejeelinkline((unsigned char *)lines[i].line, &rtype, &rtlen, vals);
+    }
+    tfull = benchns() - t0;
+    printf("%-28s %3s %12.1f %12.1f\n", lines[i].name, "",
+           (double)tparse / BENCHITERATIONS, (double)tfull / BENCHITERATIONS);
+  }
+  printf("\n%-44s %12s\n", "outputformat", "render ns");
+  for (i = 0; i < (sizeof(fmts) / sizeof(fmts[0])); i++) {
+    parsesensorkey((unsigned char *)fmts[i].sensor, &stype, &sid, NULL);
+    ss = getsensorstate(stype, sid);
+    compilefmt(&cf, (unsigned char *)fmts[i].fmt);
+    t0 = benchns();
+    for (j = 0; j < BENCHITERATIONS; j++) {
+      sink += renderfmt(outbuf, sizeof(outbuf), &cf, ss, ss->lastseen);
+    }
+    tfull = benchns() - t0;
+    freecompiledfmt(&cf);
+    printf("%-3s %-40s %12.1f\n", fmts[i].sensor, fmts[i].fmt,
+           (double)tfull / BENCHITERATIONS);
+  }
+  printf("\n%-44s %12s\n", "other", "ns");
+  parseculline((unsigned char *)lines[7].line, &f);
+  t0 = benchns();
+  for (j = 0; j < BENCHITERATIONS; j++) {
+    sink += lcccrc(&f.data[0], f.len);
+  }
+  tfull = benchns() - t0;
+  printf("%-44s %12.2f\n", "LaCrosse CRC, per byte",
+         (double)tfull / ((double)BENCHITERATIONS * f.len));
+  VERBPRINT(1, "(%lu)\n", sink); /* so none of the above gets optimized away */
+}
+
+/* Adds a receiver from a -d parameter: "[type:]device". */
+static void addreceiver(char * spec) {
+  struct receiver * rc;
+  struct receiver ** prc;
+
+  rc = calloc(sizeof(struct receiver), 1);
+  if (rc == NULL) {
+    fprintf(stderr, "ERROR: out of memory.\n");
+    exit(1);
+  }
+  rc->type = -1;
+  rc->fd = -1;
+  if (strncmp(spec, "jeelink:", 8) == 0) {
+    rc->type = RECTJEELINK;
+    spec += 8;
+  } else if (strncmp(spec, "cul:", 4) == 0) {
+    rc->type = RECTCUL;
+    spec += 4;
+  } else if (strncmp(spec, "davis:", 6) == 0) {
+    rc->type = RECTJEELDAVISV;
+    spec += 6;
+  }
+  rc->devname = (unsigned char *)strdup(spec);
+  /* keep them in the order they were given */
+  for (prc = &receivers; *prc != NULL; prc = &(*prc)->next) { }
+  *prc = rc;
+}
+
+int main(int argc, char ** argv)
+{
+  int curarg;
+  int forcebitrate = 0;
+  int replayrealtime = 0;
+  struct receiver * rc;
+  int i;
+
+  for (curarg = 1; curarg < argc; curarg++) {
+    if        (strcmp(argv[curarg], "-v") == 0) {
+      verblev++;
+    } else if (strcmp(argv[curarg], "-q") == 0) {
+      verblev--;
+    } else if (strcmp(argv[curarg], "-f") == 0) {
+      runinforeground = 1;
+    } else if (strcmp(argv[curarg], "-C") == 0) {
+      receivertype = RECTCUL;
+    } else if (strcmp(argv[curarg], "-D") == 0) {
+      receivertype = RECTJEELDAVISV;
+    } else if (strcmp(argv[curarg], "-h") == 0) {
+      usage(argv[0]); exit(0);
+    } else if (strcmp(argv[curarg], "--help") == 0) {
+      usage(argv[0]); exit(0);
+    } else if (strcmp(argv[curarg], "--realtime") == 0) {
+      replayrealtime = 1;
+    } else if (strcmp(argv[curarg], "--restartonerror") == 0) {
+      restartonerror += 5;
+    } else if (strcmp(argv[curarg], "-d") == 0) {
+      curarg++;
+      if (curarg >= argc) {
+        fprintf(stderr, "ERROR: -d requires a parameter!\n");
+        usage(argv[0]); exit(1);
+      }
+      addconfigstr(&cmdlineconfig.receivers, &cmdlineconfig.nreceivers, argv[curarg]);
+    } else if (strcmp(argv[curarg], "-c") == 0) {
+      curarg++;
+      if (curarg >= argc) {
+        fprintf(stderr, "ERROR: -c requires a parameter!\n");
+        usage(argv[0]); exit(1);
+      }
+      configfile = argv[curarg];
+    } else if (strcmp(argv[curarg], "-r") == 0) {
+      curarg++;
+      if (curarg >= argc) {
+        fprintf(stderr, "ERROR: -r requires a parameter!\n");
+        usage(argv[0]); exit(1);
+      }
+      forcebitrate = strtol(argv[curarg], NULL, 10);
+      if (forcebitrate == 1) { forcebitrate = 9579; }
+      if (forcebitrate == 2) { forcebitrate = 17241; }
+    } else if (strcmp(argv[curarg], "-H") == 0) {
+      curarg++;
+      if (curarg >= argc) {
+        fprintf(stderr, "ERROR: -H requires a parameter!\n");
+        usage(argv[0]); exit(1);
+      }
+      histsize = strtoul(argv[curarg], NULL, 10);
+    } else if (strcmp(argv[curarg], "-A") == 0) {
+      userollups = 1;
+    } else if (strcmp(argv[curarg], "-l") == 0) {
+      curarg++;
+      if (curarg >= argc) {
+        fprintf(stderr, "ERROR: -l requires a parameter!\n");
+        usage(argv[0]); exit(1);
+      }
+      logdir = strdup(argv[curarg]);
+    } else if (strcmp(argv[curarg], "-S") == 0) {
+      curarg++;
+      if (curarg >= argc) {
+        fprintf(stderr, "ERROR: -S requires a parameter!\n");
+        usage(argv[0]); exit(1);
+      }
+      statsport = strtoul(argv[curarg], NULL, 10);
+    } else if (strcmp(argv[curarg], "-m") == 0) {
+      curarg++;
+      if (curarg >= argc) {
+        fprintf(stderr, "ERROR: -m requires a parameter!\n");
+        usage(argv[0]); exit(1);
+      }
+      shmname = argv[curarg];
+    } else if (strcmp(argv[curarg], "-M") == 0) {
+      curarg++;
+      if (curarg >= argc) {
+        fprintf(stderr, "ERROR: -M requires a parameter!\n");
+        usage(argv[0]); exit(1);
+      }
+      mcastdest = argv[curarg];
+    } else if (strcmp(argv[curarg], "-P") == 0) {
+      curarg++;
+      if (curarg >= argc) {
+        fprintf(stderr, "ERROR: -P requires a parameter!\n");
+        usage(argv[0]); exit(1);
+      }
+      metricsport = strtoul(argv[curarg], NULL, 10);
+    } else if (strcmp(argv[curarg], "-Q") == 0) {
+      curarg++;
+      if (curarg >= argc) {
+        fprintf(stderr, "ERROR: -Q requires a parameter!\n");
+        usage(argv[0]); exit(1);
+      }
+      queryport = strtoul(argv[curarg], NULL, 10);
+    } else {
+      /* Unknown - must be the command. */
+      break;
+    }
+  }
+  if (curarg == argc) {
+    fprintf(stderr, "ERROR: No command given!\n");
+    usage(argv[0]);
+    exit(1);
+  }
+  if (strcmp(argv[curarg], "bench") == 0) {
+    dobench();
+    exit(0);
+  }
+  if (strcmp(argv[curarg], "replay") == 0) { /* Replay mode */
+    unsigned char stype, sid;
+    curarg++;
+    if (curarg >= argc) {
+      fprintf(stderr, "ERROR: replay requires a file to replay.\n");
+      exit(1);
+    }
+    if ((curarg + 1) >= argc) {
+      trackallsensors = 1;
+    }
+    for (i = curarg + 1; i < argc; i++) {
+      if ((parsesensorkey((unsigned char *)argv[i], &stype, &sid, NULL) != 0)
+       || (getsensorstate(stype, sid) == NULL)) {
+        fprintf(stderr, "ERROR: Unknown sensor '%s'.\n", argv[i]);
+        exit(1);
+      }
+    }
+    doreplay(argv[curarg], replayrealtime);
+    exit(0);
+  }
+  if (cmdlineconfig.nreceivers == 0) {
+    addconfigstr(&cmdlineconfig.receivers, &cmdlineconfig.nreceivers, serialport);
+  }
+  cmdlineconfig.forcebitrate = forcebitrate;
+  cmdlineconfig.queryport = queryport;
+  cmdlineconfig.metricsport = metricsport;
+  cmdlineconfig.statsport = statsport;
+  if (strcmp(argv[curarg], "daemon") == 0) {
+    for (i = curarg + 1; i < argc; i++) {
+      addconfigstr(&cmdlineconfig.sensors, &cmdlineconfig.nsensors, argv[i]);
+    }
+  }
+  if (readconfig(configfile, &runningconfig) != 0) {
+    exit(1);
+  }
+  forcebitrate = runningconfig.forcebitrate;
+  queryport = runningconfig.queryport;
+  metricsport = runningconfig.metricsport;
+  statsport = runningconfig.statsport;
+  for (i = 0; i < runningconfig.nreceivers; i++) {
+    addreceiver(runningconfig.receivers[i]);
+  }
+  for (rc = receivers; rc != NULL; rc = rc->next) {
+    if (rc->type < 0) {
+      rc->type = receivertype;
+    }
+    rc->fd = open(rc->devname, O_NOCTTY | O_NONBLOCK | O_RDWR);
+    if (rc->fd < 0) {
+      fprintf(stderr, "ERROR: Could not open serial port %s (%s).\n", rc->devname, strerror(errno));
+      exit(1);
+    }
+  }
+  if (strcmp(argv[curarg], "daemon") == 0) { /* Daemon mode */
+    struct daemondata * mydaemondata = NULL;
+    {
+      /* We can serve far more ports than the usual soft limit of 1024 open
+       * files would allow, so raise that as far as we are permitted to. */
+      struct rlimit rl;
+      if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+          VERBPRINT(1, "WARNING: failed to raise limit for open files: %s\n", strerror(errno));
+        }
+      }
+    }
+    for (i = 0; i < runningconfig.nsensors; i++) {
+      struct daemondata * newdd;
+
+      if ((newdd = parsedaemonparam(runningconfig.sensors[i], &runningconfig)) == NULL) {
         exit(1);
       }
-      if (listen(mydaemondata->fd, 20) < 0) { /* Large Queue as we might block for some time while reading */
-        perror("Listen failed");
+      newdd->next = mydaemondata;
+      mydaemondata = newdd;
+      servesensor(newdd);
+      /* Open the port */
+      if ((newdd->port != 0) && ((newdd->fd = openlistener(newdd->port)) < 0)) {
         exit(1);
       }
-      curarg++;
-    } while (curarg < argc);
+    }
+    if ((queryport != 0) && ((querylistenfd = openlistener(queryport)) < 0)) {
+      exit(1);
+    }
+    if ((metricsport != 0) && ((metricslistenfd = openlistener(metricsport)) < 0)) {
+      exit(1);
+    }
+    if ((statsport != 0) && ((statslistenfd = openlistener(statsport)) < 0)) {
+      exit(1);
+    }
+    if (shmname != NULL) {
+      openshm(shmname);
+    }
+    if (logdir != NULL) {
+      findoldestlogday();
+    }
+    restorestate();
+    if (mcastdest != NULL) {
+      if ((mcastfd = openmcast(mcastdest)) < 0) {
+        fprintf(stderr, "ERROR: -M needs address:port, not '%s'.\n", mcastdest);
+        exit(1);
+      }
+    }
     if (mydaemondata == NULL) {
-      fprintf(stderr, "ERROR: the daemon command requires parameters.\n");
+      fprintf(stderr, "ERROR: the daemon command requires parameters (or sensors in the config file).\n");
       exit(1);
     }
-    {
-      /* configure serial port parameters */
+    /* configure serial port parameters */
+    for (rc = receivers; rc != NULL; rc = rc->next) {
       struct termios tio;
-      /* Init string is assembled in two stages: First the static part, then
-       * the part that depends on settings or sensors. */
-      /* Static part: */
-      if (receivertype == RECTJEELINK) {
-        strcpy(jlinitstr, "0a "); /* Turn off that annoying ultrabright blue LED */
-      } else if (receivertype == RECTCUL) {
-        strcpy(jlinitstr, "");
-        /* While there is a command to turn off the blinking blue LED on
-         * the CUL (although it's less ultrabright and annoying than the
-         * one on the Jeelink), that command is persistent across reboots
-         * because it writes to the EEPROM. It is therefore recommended
-         * to NOT add it to the initstring because it's only needed once,
-         * and sending it repeatedly will wear down the EEPROM.
-         * Just send it once manually, e.g. with something like
-         * "echo l00 > /dev/ttyACMn" in a terminal. */
-      } else if (receivertype == RECTJEELDAVISV) {
-        strcpy(jlinitstr, "2b"); /* radio band: EU */
-        strcat(jlinitstr, "0d"); /* debug mode: off */
-        strcat(jlinitstr, "0l"); /* activity LED: off */
-        strcat(jlinitstr, "0p"); /* show raw payload data: off */
-        strcat(jlinitstr, "1r"); /* receive mode: enable */
-      }
-      /* dynamic part: */
-      if (receivertype == RECTJEELINK) {
-        if (forcebitrate == 0) {
-          if (havefastsensors) { /* do we have at least 1 sensor that could use the faster rate of 17241? */
-            strcat(jlinitstr, "30t "); /* Set to automatically switch data rate every 30 seconds */
-          } else {
-            strcat(jlinitstr, "1r "); /* Fixed slow rate of 9579 */
-          }
-        } else if (forcebitrate < 0) {
-          strcat(jlinitstr, "30t "); /* Set to automatically switch data rate every 30 seconds */
-        } else if (forcebitrate == 9579) {
-          strcat(jlinitstr, "1r "); /* Fixed slow rate of 9579 */
-        } else if (forcebitrate == 17241) {
-          strcat(jlinitstr, "0r "); /* Fixed fast rate of 17241 */
-        } else {
-          fprintf(stderr, "WARNING: Don't know how to do a bitrate of %d, ignoring bitrate setting!\n", forcebitrate);
-        }
-        strcat(jlinitstr, "?"); /* show firmware version */
-      } else if (receivertype == RECTCUL) {
-        if (forcebitrate <= 0) {
-          fprintf(stderr, "ERROR: with CUL as a receiver, you currently need to specify a fixed bitrate, as it cannot automatically switch.\n");
-          exit(1);
-        } else if (forcebitrate == 9579) {
-          strcat(jlinitstr, "Nr2\r\n");
-        } else if (forcebitrate == 17241) {
-          strcat(jlinitstr, "Nr1\r\n");
-        } else {
-          fprintf(stderr, "ERROR: Don't know how to program a bitrate of %d into CUL!\n", forcebitrate);
-          exit(1);
-        }
-        strcat(jlinitstr, "V\r\nVH\r\n"); /* show firmware and hardware version */
-        /* If you have problems with the reception, you can try playing around with
-         * the Automatic Gain settings in the AGCTRL0-2 registers. See the datasheet
-         * of the CC1101 for details.
-         * The settings we set here worked best _for me_. However, since this chip
-         * seems to be _extremely_ finicky, YMMV. */
-        /* AGCTRL2 (register 0x1B) sets (among other things) the target amplitude.
-         * According to culfw documentation, the default value should be 0x07, but
-         * in the 'native mode' we use, the firmware sets it to 0x43 instead -
-         * which disallows the highest gain setting.
-         * Values probably worth trying: 07 - target amplitude 42 dB;
-         * 47 / 43 - TA 42 dB / 33 dB, highest DVGA gain disallowed */
-        strcat(jlinitstr, "Cw1b07\r\n");
-        /* AGCTRL1 (register 0x1C) sets (among other things) strategies for AGC.
-         * default set by the firmware in native mode is 0x68, which selects
-         * "strategy 1" with a relative carrier detection threshold of 10 dB
-         * relative RSSI increase and disabled absolute c.d.t..
-         * Value definitely worth trying: 40 which is the poweron-default of the
-         * chip and worked really well in one case. */
-        strcat(jlinitstr, "Cw1c00\r\n");
-        /* AGCTRL0 (register 0x1D) sets (among other things) the decision boundary.
-         * the default value is 0x91 which selects 8db decision boundary.
-         * this value is not touched by the firmware in native mode, so has the
-         * poweron default value. */
-        strcat(jlinitstr, "Cw1d81\r\n");
-        /* Show values of AGCTRL2-AGCTRL0 registers */
-        /*strcat(jlinitstr, "C1b\r\nC1c\r\nC1d\r\n"); */
-      } else if (receivertype == RECTJEELDAVISV) {
-        struct daemondata * curdd;
-        /* FIXME: this really should to be modifyable on the commandline.
-         * as should the station type below. */
-        strcat(jlinitstr, "300h"); /* height above sealevel in m: 300 */
-        curdd = mydaemondata;
-        while (curdd != NULL) {
-          if (curdd->sensortype == 'V') {
-            sprintf(&jlinitstr[strlen(jlinitstr)], "%d,0s", curdd->sensorid);
-          }
-          curdd = curdd->next;
-        }
-        strcat(jlinitstr, "v");
+      if (buildinitstr(rc, rc->initstr, havefastsensors(mydaemondata), forcebitrate) != 0) {
+        exit(1);
       }
-      VERBPRINT(4, "Assembled initstring is: %s\n", jlinitstr);
-      tcgetattr(serialfd, &tio);
-      if (receivertype == RECTJEELINK) {
+      tcgetattr(rc->fd, &tio);
+      if (rc->type == RECTJEELINK) {
         cfsetspeed(&tio, B57600);
-      } else if (receivertype == RECTCUL) {
+      } else if (rc->type == RECTCUL) {
         cfsetspeed(&tio, B115200);
-      } else if (receivertype == RECTJEELDAVISV) {
+      } else if (rc->type == RECTJEELDAVISV) {
         cfsetspeed(&tio, B57600);
       }
       tio.c_lflag &= ~(ICANON | ECHO); /* Clear ICANON and ECHO. */
       tio.c_iflag &= ~(IXON | IGNBRK); /* no flow control */
       tio.c_cflag &= ~(CSTOPB); /* just one stop bit */
-      tcsetattr(serialfd, TCSAFLUSH, &tio);
-      /* Now give the jeelink some time to reboot, then send the init string */
-      sleep(2);
-      if (write(serialfd, jlinitstr, strlen(jlinitstr)) != strlen(jlinitstr)) {
-        fprintf(stderr, "%s\n", "WARNING: init-string was not sent to the Jeelink successfully.");
+      /* The reading thread blocks until there is data. Once data arrives,
+       * read() only returns when the line(s) are over, that is after
+       * 0.1 seconds without another byte, or when 255 bytes have arrived.
+       * So usually, every line takes just one wakeup. */
+      tio.c_cc[VMIN] = 255;
+      tio.c_cc[VTIME] = 1;
+      tcsetattr(rc->fd, TCSAFLUSH, &tio);
+    }
+    /* Now give the receivers some time to reboot, then send the init strings */
+    sleep(2);
+    for (rc = receivers; rc != NULL; rc = rc->next) {
+      if (write(rc->fd, rc->initstr, strlen(rc->initstr)) != strlen(rc->initstr)) {
+        fprintf(stderr, "WARNING: init-string was not sent to the receiver on %s successfully.\n", rc->devname);
       }
+      rc->lastsentinit = time(NULL);
     }
     /* the good old doublefork trick from 'systemprogrammierung 1' */
     if (runinforeground != 1) {
@@ -1096,8 +4590,10 @@ int main(int argc, char ** argv)
       sigemptyset(&sia.sa_mask); /* If we don't do this, we're likely */
       sia.sa_flags = 0;          /* to die from 'broken pipe'! */
       sigaction(SIGPIPE, &sia, NULL);
+      sia.sa_handler = sighuphandler;
+      sigaction(SIGHUP, &sia, NULL); /* no SA_RESTART, so epoll_wait returns */
     }
-    dodaemon(serialfd, mydaemondata, argv, jlinitstr);
+    dodaemon(mydaemondata, argv);
   } else {
     fprintf(stderr, "ERROR: Command '%s' is unknown.\n", argv[curarg]);
     usage(argv[0]);
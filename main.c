@@ -14,6 +14,7 @@
 #include <util/delay.h>
 
 #include "adc.h"
+#include "crc8.h"
 #include "eeprom.h"
 #include "rfm12.h"
 #include "sht31.h"
@@ -46,18 +47,10 @@ static uint8_t frametosend[10];
 
 static uint8_t calculatecrc(uint8_t * data, uint8_t len)
 {
-  uint8_t i, j;
+  uint8_t j;
   uint8_t res = 0;
   for (j = 0; j < len; j++) {
-    uint8_t val = data[j];
-    for (i = 0; i < 8; i++) {
-      uint8_t tmp = (uint8_t)((res ^ val) & 0x80);
-      res <<= 1;
-      if (0 != tmp) {
-        res ^= 0x31;
-      }
-      val <<= 1;
-    }
+    res = crc8_update(res, data[j]);
   }
   return res;
 }
@@ -8,6 +8,7 @@
 #include <avr/io.h>
 #include <inttypes.h>
 #include <util/delay.h>
+#include "crc8.h"
 #include "sht31.h"
 
 /* The Port used for the connection */
@@ -182,25 +183,7 @@ void sht31_startmeas(void)
 /* This function is based on Sensirons example code and datasheet */
 uint8_t sht31_crc(uint8_t b1, uint8_t b2)
 {
-  uint8_t crc = 0xff; /* Start value */
-  uint8_t b;
-  crc ^= b1;
-  for (b = 0; b < 8; b++) {
-    if (crc & 0x80) {
-      crc = (crc << 1) ^ 0x131;
-    } else {
-      crc = crc << 1;
-    }
-  }
-  crc ^= b2;
-  for (b = 0; b < 8; b++) {
-    if (crc & 0x80) {
-      crc = (crc << 1) ^ 0x131;
-    } else {
-      crc = crc << 1;
-    }
-  }
-  return crc;
+  return crc8_update(crc8_update(0xff, b1), b2); /* Start value is 0xff */
 }
 
 void sht31_read(struct sht31data * d)